@@ -0,0 +1,113 @@
+/*
+ * BackProjection.hpp
+ *
+ *  Pinhole back-projection of colour image pixels with per-column and
+ *  per-row ray tables, so recovering a 3D point is a multiply per axis.
+ *  The tables follow the CameraInfo of the frames and are only rebuilt
+ *  when the intrinsics or the resolution change.
+ */
+
+#pragma once
+
+   // c++
+   #include <vector>
+
+   // OpenCv
+   #include <opencv2/core/core.hpp>
+
+   // ROS
+   #include <sensor_msgs/CameraInfo.h>
+
+namespace darknet_ros
+{
+   // Pinhole intrinsics of an image of width x height pixels.
+   typedef struct
+   {
+      double fx, fy, cx, cy;
+      int width, height;
+   }
+   CameraIntrinsics_;
+
+   // Intrinsics of a CameraInfo scaled to the size of the image they are used with - @return false if K is unset.
+   inline bool intrinsicsFromCameraInfo(const sensor_msgs::CameraInfo& info, int width, int height, CameraIntrinsics_& intrinsics)
+   {
+      if (info.K[0] <= 0 || info.K[4] <= 0)
+      {
+         return false;
+      }
+      double sx = info.width > 0 ? (double) width / info.width : 1.;
+      double sy = info.height > 0 ? (double) height / info.height : 1.;
+      intrinsics.fx = info.K[0] * sx;
+      intrinsics.cx = info.K[2] * sx;
+      intrinsics.fy = info.K[4] * sy;
+      intrinsics.cy = info.K[5] * sy;
+      intrinsics.width = width;
+      intrinsics.height = height;
+      return true;
+   }
+
+   class BackProjection
+   {
+      public:
+
+      BackProjection()
+      {
+         intrinsics_.fx = intrinsics_.fy = intrinsics_.cx = intrinsics_.cy = 0;
+         intrinsics_.width = intrinsics_.height = 0;
+      }
+
+      // Rebuilds the ray tables if the intrinsics or the resolution changed - @return true if rebuilt.
+      bool update(const CameraIntrinsics_& intrinsics)
+      {
+         if (intrinsics.fx == intrinsics_.fx && intrinsics.fy == intrinsics_.fy
+             && intrinsics.cx == intrinsics_.cx && intrinsics.cy == intrinsics_.cy
+             && intrinsics.width == intrinsics_.width && intrinsics.height == intrinsics_.height)
+         {
+            return false;
+         }
+         intrinsics_ = intrinsics;
+         rayX_.resize(intrinsics_.width);
+         rayY_.resize(intrinsics_.height);
+         for (int u = 0; u < intrinsics_.width; ++u)
+         {
+            rayX_[u] = (u - intrinsics_.cx) / intrinsics_.fx;
+         }
+         for (int v = 0; v < intrinsics_.height; ++v)
+         {
+            rayY_[v] = (v - intrinsics_.cy) / intrinsics_.fy;
+         }
+         return true;
+      }
+
+      const CameraIntrinsics_& intrinsics() const
+      {
+         return intrinsics_;
+      }
+
+      // (u - cx) / fx, from the table for pixels inside the image.
+      float rayX(float u) const
+      {
+         int i = (int) u;
+         return (i == u && i >= 0 && i < (int) rayX_.size()) ? rayX_[i] : (u - intrinsics_.cx) / intrinsics_.fx;
+      }
+
+      // (v - cy) / fy, from the table for pixels inside the image.
+      float rayY(float v) const
+      {
+         int i = (int) v;
+         return (i == v && i >= 0 && i < (int) rayY_.size()) ? rayY_[i] : (v - intrinsics_.cy) / intrinsics_.fy;
+      }
+
+      // Point at depth z along the ray of pixel (u, v), in the units of z.
+      cv::Vec3f point(float u, float v, float z) const
+      {
+         return cv::Vec3f(rayX(u) * z, rayY(v) * z, z);
+      }
+
+      private:
+
+      CameraIntrinsics_ intrinsics_;
+      std::vector<float> rayX_;
+      std::vector<float> rayY_;
+   };
+}
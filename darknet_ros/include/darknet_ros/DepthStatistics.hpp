@@ -0,0 +1,364 @@
+/*
+ * DepthStatistics.hpp
+ *
+ *  Robust depth summary of an image region (optionally masked) for the
+ *  3D position stage. One row-major scan serves every statistic; 32FC1
+ *  and 16UC1 depth images are both supported, in the units of the image.
+ *  DepthIntegral precomputes a frame so that rectangle means cost O(1).
+ */
+
+#pragma once
+
+   // c++
+   #include <algorithm>
+   #include <cmath>
+   #include <cstdint>
+   #include <cstring>
+   #include <limits>
+   #include <vector>
+
+   // OpenCv
+   #include <opencv2/core/core.hpp>
+
+   #if defined(__SSE2__)
+   #include <emmintrin.h>
+   #elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+   #include <arm_neon.h>
+   #endif
+
+namespace darknet_ros
+{
+   // Statistic used as the depth of a box.
+   enum DepthStatistic
+   {
+      DEPTH_MEAN,
+      DEPTH_MEDIAN,
+      DEPTH_TRIMMED_MEAN,
+      DEPTH_PERCENTILE
+   };
+
+   // Depth samples that are NaN, infinite or <= 0 (32FC1) or 0 (16UC1) carry no measurement.
+   inline bool isValidDepth(float v)
+   {
+      return v > 0.f && v < std::numeric_limits<float>::infinity();
+   }
+
+   inline bool isValidDepth(uint16_t v)
+   {
+      return v != 0;
+   }
+
+   // Summary of the valid samples, all NaN when count is 0.
+   typedef struct
+   {
+      int count;
+      float mean;
+      float median;
+      float percentile;
+      float trimmedMean;
+   }
+   DepthStats_;
+
+   class DepthStatistics
+   {
+      public:
+
+      // @param[in] percentile in [0,1] - @param[in] trim fraction cut from each end for the trimmed mean.
+      DepthStatistics(float percentile = 0.1f, float trim = 0.1f) : percentile_(percentile), trim_(trim) {}
+
+      void setPercentile(float percentile)
+      {
+         percentile_ = std::min(std::max(percentile, 0.f), 1.f);
+      }
+
+      void setTrim(float trim)
+      {
+         trim_ = std::min(std::max(trim, 0.f), 0.49f);
+      }
+
+      // Summarizes the valid depth inside roi where mask (CV_8UC1, roi-sized, may be empty) is non-zero.
+      // @param[in] orderStatistics also compute median, percentile and trimmed mean.
+      DepthStats_ compute(const cv::Mat& depth, cv::Rect roi, const cv::Mat& mask, bool orderStatistics)
+      {
+         const float nan = std::numeric_limits<float>::quiet_NaN();
+         DepthStats_ stats = {0, nan, nan, nan, nan};
+         roi &= cv::Rect(0, 0, depth.cols, depth.rows);
+         if (roi.area() == 0 || (depth.type() != CV_32FC1 && depth.type() != CV_16UC1)
+             || (!mask.empty() && (mask.type() != CV_8UC1 || mask.cols < roi.width || mask.rows < roi.height)))
+         {
+            return stats;
+         }
+
+         double sum = 0;
+         long count = 0;
+         samples_.clear();
+         for (int y = 0; y < roi.height; ++y)
+         {
+            const uchar *m = mask.empty() ? 0 : mask.ptr<uchar>(y);
+            if (depth.type() == CV_32FC1)
+            {
+               const float *d = depth.ptr<float>(roi.y + y) + roi.x;
+               orderStatistics ? gatherRow(d, m, roi.width, sum, count) : accumulateRow(d, m, roi.width, sum, count);
+            }
+            else
+            {
+               const uint16_t *d = depth.ptr<uint16_t>(roi.y + y) + roi.x;
+               orderStatistics ? gatherRow(d, m, roi.width, sum, count) : accumulateRow(d, m, roi.width, sum, count);
+            }
+         }
+
+         stats.count = count;
+         if (count == 0)
+         {
+            return stats;
+         }
+         stats.mean = sum / count;
+         if (!orderStatistics)
+         {
+            return stats;
+         }
+
+         std::vector<float>::iterator begin = samples_.begin();
+         size_t n = samples_.size();
+         std::nth_element(begin, begin + n / 2, samples_.end());
+         stats.median = samples_[n / 2];
+         size_t p = std::min(n - 1, (size_t) (percentile_ * (n - 1) + 0.5f));
+         std::nth_element(begin, begin + p, samples_.end());
+         stats.percentile = samples_[p];
+
+         // Partition off both tails, the middle part is then summed in any order.
+         size_t lo = trim_ * n;
+         size_t hi = n - lo;
+         if (lo > 0)
+         {
+            std::nth_element(begin, begin + lo, samples_.end());
+            std::nth_element(begin + lo, begin + hi - 1, samples_.end());
+         }
+         double trimmed = 0;
+         for (size_t i = lo; i < hi; ++i)
+         {
+            trimmed += samples_[i];
+         }
+         stats.trimmedMean = trimmed / (hi - lo);
+         return stats;
+      }
+
+      // Picks one statistic of a computed summary.
+      static float select(const DepthStats_& stats, DepthStatistic statistic)
+      {
+         switch (statistic)
+         {
+            case DEPTH_MEDIAN:
+               return stats.median;
+            case DEPTH_TRIMMED_MEAN:
+               return stats.trimmedMean;
+            case DEPTH_PERCENTILE:
+               return stats.percentile;
+            default:
+               return stats.mean;
+         }
+      }
+
+      private:
+
+      // Sum and count only, branch-free so the 16 bit loop vectorizes; float rows use SIMD.
+      static void accumulateRow(const uint16_t *d, const uchar *m, int n, double& sum, long& count)
+      {
+         uint32_t rowSum = 0;
+         int rowCount = 0;
+         for (int x = 0; x < n; ++x)
+         {
+            uint32_t valid = (d[x] != 0) & (!m || m[x] != 0);
+            rowSum += valid * d[x];
+            rowCount += valid;
+         }
+         sum += rowSum;
+         count += rowCount;
+      }
+
+      static void accumulateRow(const float *d, const uchar *m, int n, double& sum, long& count)
+      {
+         int x = 0;
+         float rowSum = 0;
+         int rowCount = 0;
+#if defined(__SSE2__)
+         const __m128 zero = _mm_setzero_ps();
+         const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+         const __m128i zeroi = _mm_setzero_si128();
+         __m128 vsum = _mm_setzero_ps();
+         __m128i vcount = _mm_setzero_si128();
+         for (; x + 4 <= n; x += 4)
+         {
+            __m128 v = _mm_loadu_ps(d + x);
+            // Comparisons with NaN are false, so NaN drops out here too.
+            __m128 valid = _mm_and_ps(_mm_cmpgt_ps(v, zero), _mm_cmplt_ps(v, inf));
+            if (m)
+            {
+               int32_t bytes;
+               memcpy(&bytes, m + x, sizeof(bytes));
+               __m128i mi = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zeroi), zeroi);
+               valid = _mm_andnot_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(mi, zeroi)), valid);
+            }
+            vsum = _mm_add_ps(vsum, _mm_and_ps(valid, v));
+            vcount = _mm_sub_epi32(vcount, _mm_castps_si128(valid));
+         }
+         float lanes[4];
+         int32_t counts[4];
+         _mm_storeu_ps(lanes, vsum);
+         _mm_storeu_si128((__m128i*) counts, vcount);
+         rowSum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+         rowCount = counts[0] + counts[1] + counts[2] + counts[3];
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+         const float32x4_t zero = vdupq_n_f32(0.f);
+         const float32x4_t inf = vdupq_n_f32(std::numeric_limits<float>::infinity());
+         float32x4_t vsum = zero;
+         uint32x4_t vcount = vdupq_n_u32(0);
+         for (; x + 4 <= n; x += 4)
+         {
+            float32x4_t v = vld1q_f32(d + x);
+            uint32x4_t valid = vandq_u32(vcgtq_f32(v, zero), vcltq_f32(v, inf));
+            if (m)
+            {
+               uint32_t bytes;
+               memcpy(&bytes, m + x, sizeof(bytes));
+               uint8x8_t mb = vreinterpret_u8_u32(vdup_n_u32(bytes));
+               uint32x4_t mi = vmovl_u16(vget_low_u16(vmovl_u8(mb)));
+               valid = vandq_u32(valid, vtstq_u32(mi, mi));
+            }
+            vsum = vaddq_f32(vsum, vreinterpretq_f32_u32(vandq_u32(valid, vreinterpretq_u32_f32(v))));
+            vcount = vsubq_u32(vcount, valid);
+         }
+         float lanes[4];
+         uint32_t counts[4];
+         vst1q_f32(lanes, vsum);
+         vst1q_u32(counts, vcount);
+         rowSum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+         rowCount = counts[0] + counts[1] + counts[2] + counts[3];
+#endif
+         for (; x < n; ++x)
+         {
+            if (isValidDepth(d[x]) && (!m || m[x]))
+            {
+               rowSum += d[x];
+               ++rowCount;
+            }
+         }
+         sum += rowSum;
+         count += rowCount;
+      }
+
+      // Sum, count and the compacted samples for the order statistics.
+      template <typename T>
+      void gatherRow(const T *d, const uchar *m, int n, double& sum, long& count)
+      {
+         for (int x = 0; x < n; ++x)
+         {
+            if (isValidDepth(d[x]) && (!m || m[x]))
+            {
+               samples_.push_back(d[x]);
+               sum += d[x];
+               ++count;
+            }
+         }
+      }
+
+      float percentile_;
+      float trim_;
+      std::vector<float> samples_;   // Reused between calls.
+   };
+
+   // Summed-area tables of the valid depth and of its sample count.
+   class DepthIntegral
+   {
+      public:
+
+      DepthIntegral() : cols_(0), rows_(0) {}
+
+      // Builds the tables in one row-major pass, counting only pixels where mask (CV_8UC1, depth-sized, may be empty) is non-zero - @return true if successful.
+      bool build(const cv::Mat& depth, const cv::Mat& mask)
+      {
+         clear();
+         if (depth.empty() || (depth.type() != CV_32FC1 && depth.type() != CV_16UC1)
+             || (!mask.empty() && (mask.type() != CV_8UC1 || mask.cols != depth.cols || mask.rows != depth.rows)))
+         {
+            return false;
+         }
+         cols_ = depth.cols;
+         rows_ = depth.rows;
+         sum_.assign((size_t) (cols_ + 1) * (rows_ + 1), 0.);
+         count_.assign((size_t) (cols_ + 1) * (rows_ + 1), 0);
+         if (depth.type() == CV_32FC1)
+            buildRows<float>(depth, mask);
+         else
+            buildRows<uint16_t>(depth, mask);
+         return true;
+      }
+
+      bool isBuilt() const
+      {
+         return cols_ > 0;
+      }
+
+      void clear()
+      {
+         cols_ = rows_ = 0;
+      }
+
+      // Count and mean of the valid samples inside roi, the order statistics are NaN.
+      DepthStats_ mean(cv::Rect roi) const
+      {
+         const float nan = std::numeric_limits<float>::quiet_NaN();
+         DepthStats_ stats = {0, nan, nan, nan, nan};
+         roi &= cv::Rect(0, 0, cols_, rows_);
+         if (roi.area() == 0)
+         {
+            return stats;
+         }
+         size_t stride = cols_ + 1;
+         size_t a = roi.y * stride + roi.x;
+         size_t b = a + roi.width;
+         size_t c = a + roi.height * stride;
+         size_t d = c + roi.width;
+         stats.count = count_[d] - count_[b] - count_[c] + count_[a];
+         if (stats.count > 0)
+         {
+            stats.mean = (sum_[d] - sum_[b] - sum_[c] + sum_[a]) / stats.count;
+         }
+         return stats;
+      }
+
+      private:
+
+      template <typename T>
+      void buildRows(const cv::Mat& depth, const cv::Mat& mask)
+      {
+         size_t stride = cols_ + 1;
+         for (int y = 0; y < rows_; ++y)
+         {
+            const T *d = depth.ptr<T>(y);
+            const uchar *m = mask.empty() ? 0 : mask.ptr<uchar>(y);
+            const double *sumAbove = &sum_[y * stride];
+            const int32_t *countAbove = &count_[y * stride];
+            double *sumRow = &sum_[(y + 1) * stride];
+            int32_t *countRow = &count_[(y + 1) * stride];
+            double rowSum = 0;
+            int32_t rowCount = 0;
+            for (int x = 0; x < cols_; ++x)
+            {
+               if (isValidDepth(d[x]) && (!m || m[x]))
+               {
+                  rowSum += d[x];
+                  ++rowCount;
+               }
+               sumRow[x + 1] = sumAbove[x + 1] + rowSum;
+               countRow[x + 1] = countAbove[x + 1] + rowCount;
+            }
+         }
+      }
+
+      int cols_;
+      int rows_;
+      std::vector<double> sum_;
+      std::vector<int32_t> count_;
+   };
+}
@@ -0,0 +1,166 @@
+/*
+ * DetectionBuffer.hpp
+ *
+ *  Detections of one frame as a structure of arrays, grouped by class.
+ *  Boxes are appended as they are decoded, finish() buckets them by class
+ *  with a counting sort and caps every class at its top K scores. The
+ *  arrays are sized once from the output layers and reused every frame.
+ */
+
+#pragma once
+
+   // c++
+   #include <algorithm>
+   #include <cstddef>
+   #include <vector>
+
+namespace darknet_ros
+{
+   class DetectionBuffer
+   {
+      public:
+
+      DetectionBuffer() : capacity_(0), numClasses_(0), topK_(0), added_(0), dropped_(0) {}
+
+      // @param[in] capacity detections per frame - @param[in] topK detections kept per class, 0 keeps all.
+      void reset(size_t capacity, int numClasses, int topK)
+      {
+         capacity_ = capacity;
+         numClasses_ = std::max(numClasses, 0);
+         topK_ = std::max(topK, 0);
+         raw_.resize(capacity_);
+         order_.resize(capacity_);
+         x_.resize(capacity_);
+         y_.resize(capacity_);
+         w_.resize(capacity_);
+         h_.resize(capacity_);
+         prob_.resize(capacity_);
+         classId_.resize(capacity_);
+         offsets_.assign(numClasses_ + 1, 0);
+         clear();
+      }
+
+      // Starts a new frame.
+      void clear()
+      {
+         added_ = 0;
+         dropped_ = 0;
+         std::fill(offsets_.begin(), offsets_.end(), 0);
+      }
+
+      // Appends a box in relative image coordinates - @return false if the buffer is full or the class unknown.
+      bool add(float x, float y, float w, float h, float prob, int classId)
+      {
+         if (added_ >= capacity_ || classId < 0 || classId >= numClasses_)
+         {
+            ++dropped_;
+            return false;
+         }
+         Raw& box = raw_[added_++];
+         box.x = x;
+         box.y = y;
+         box.w = w;
+         box.h = h;
+         box.prob = prob;
+         box.classId = classId;
+         return true;
+      }
+
+      // Buckets the appended boxes by class, in the order they were added, or by score for capped classes.
+      void finish()
+      {
+         // offsets_[c + 1] counts class c, the prefix sum turns it into the bucket ends.
+         std::vector<size_t>& start = offsets_;
+         std::fill(start.begin(), start.end(), 0);
+         for (size_t i = 0; i < added_; ++i)
+            ++start[raw_[i].classId + 1];
+         for (int c = 0; c < numClasses_; ++c)
+            start[c + 1] += start[c];
+         for (size_t i = 0; i < added_; ++i)
+            order_[start[raw_[i].classId]++] = i;
+
+         // start[c] is now the end of bucket c; copy the survivors of every class into the arrays.
+         size_t begin = 0;
+         size_t kept = 0;
+         for (int c = 0; c < numClasses_; ++c)
+         {
+            size_t end = start[c];
+            size_t count = end - begin;
+            if (topK_ > 0 && count > (size_t) topK_)
+            {
+               std::partial_sort(order_.begin() + begin, order_.begin() + begin + topK_, order_.begin() + end,
+                                 [this](size_t a, size_t b) { return raw_[a].prob > raw_[b].prob; });
+               dropped_ += count - topK_;
+               count = topK_;
+            }
+            start[c] = kept;
+            for (size_t i = begin; i < begin + count; ++i, ++kept)
+            {
+               const Raw& box = raw_[order_[i]];
+               x_[kept] = box.x;
+               y_[kept] = box.y;
+               w_[kept] = box.w;
+               h_[kept] = box.h;
+               prob_[kept] = box.prob;
+               classId_[kept] = box.classId;
+            }
+            begin = end;
+         }
+         start[numClasses_] = kept;
+      }
+
+      // Number of detections kept by finish().
+      size_t size() const
+      {
+         return offsets_.empty() ? 0 : offsets_[numClasses_];
+      }
+
+      // Detections dropped this frame, for a full buffer or the top K cap.
+      size_t dropped() const
+      {
+         return dropped_;
+      }
+
+      int numClasses() const
+      {
+         return numClasses_;
+      }
+
+      // Detections of class c are [classBegin(c), classEnd(c)).
+      size_t classBegin(int c) const
+      {
+         return offsets_[c];
+      }
+
+      size_t classEnd(int c) const
+      {
+         return offsets_[c + 1];
+      }
+
+      float x(size_t i) const { return x_[i]; }
+      float y(size_t i) const { return y_[i]; }
+      float w(size_t i) const { return w_[i]; }
+      float h(size_t i) const { return h_[i]; }
+      float prob(size_t i) const { return prob_[i]; }
+      int classId(size_t i) const { return classId_[i]; }
+
+      private:
+
+      struct Raw
+      {
+         float x, y, w, h, prob;
+         int classId;
+      };
+
+      size_t capacity_;
+      int numClasses_;
+      int topK_;
+      size_t added_;
+      size_t dropped_;
+      std::vector<Raw> raw_;
+      std::vector<size_t> order_;
+      std::vector<size_t> offsets_;   // Bucket starts of the classes, offsets_[numClasses_] is the total.
+      std::vector<float> x_, y_, w_, h_, prob_;
+      std::vector<int> classId_;
+   };
+}
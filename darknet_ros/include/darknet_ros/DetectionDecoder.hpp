@@ -0,0 +1,167 @@
+/*
+ * DetectionDecoder.hpp
+ *
+ *  Decodes the YOLO layer outputs straight into a detection arena. Only
+ *  anchors whose objectness exceeds the threshold become detections, and
+ *  their boxes and class scores are written into storage sized once from
+ *  the network, so a frame allocates nothing. The outputs are read where
+ *  they are (a batch entry or an average), nothing is copied into layer 0.
+ *  Networks with REGION or DETECTION outputs are not decoded here, the
+ *  caller falls back to get_network_boxes for them.
+ */
+
+#pragma once
+
+   // c++
+   #include <algorithm>
+   #include <cmath>
+   #include <cstddef>
+   #include <vector>
+
+extern "C"
+{
+   #include "network.h"
+   #include "box.h"
+}
+
+namespace darknet_ros
+{
+   class DetectionDecoder
+   {
+      public:
+
+      DetectionDecoder() : direct_(false), classes_(0) {}
+
+      // Sizes the arena for the output layers of net.
+      void reset(network *net)
+      {
+         direct_ = true;
+         classes_ = 0;
+         size_t capacity = 0;
+         for (int i = 0; i < net->n; ++i)
+         {
+            const layer& l = net->layers[i];
+            if (l.type == YOLO)
+            {
+               capacity += l.w * l.h * l.n;
+               classes_ = std::max(classes_, l.classes);
+            }
+            else if (l.type == REGION || l.type == DETECTION)
+            {
+               direct_ = false;
+            }
+         }
+         if (!direct_)
+         {
+            capacity = 0;
+         }
+         dets_.resize(capacity);
+         probs_.resize(capacity * classes_);
+         for (size_t k = 0; k < capacity; ++k)
+         {
+            dets_[k].prob = &probs_[k * classes_];
+            dets_[k].mask = 0;
+         }
+      }
+
+      // @return true if every output layer is a YOLO layer, the networks decode() handles.
+      bool direct() const
+      {
+         return direct_;
+      }
+
+      // Decodes batch entry of the output layers, or the concatenated outputs in averaged when it is not null.
+      // @return the arena, valid until the next call - @param[out] nboxes detections in it.
+      detection *decode(network *net, int entry, const float *averaged, int width, int height, float thresh, int *nboxes)
+      {
+         int count = 0;
+         size_t offset = 0;
+         for (int i = 0; i < net->n; ++i)
+         {
+            const layer& l = net->layers[i];
+            if (l.type != YOLO)
+            {
+               continue;
+            }
+            const float *output = averaged ? averaged + offset : l.output + entry * l.outputs;
+            offset += l.outputs;
+            count += decodeLayer(l, output, net->w, net->h, thresh, count);
+         }
+         correctBoxes(count, width, height, net->w, net->h);
+         *nboxes = count;
+         return dets_.empty() ? 0 : &dets_[0];
+      }
+
+      private:
+
+      // Layout of get_yolo_detections: anchor n of cell i has its entries w * h apart, starting at n * w * h * (classes + 5) + i.
+      int decodeLayer(const layer& l, const float *output, int netw, int neth, float thresh, int first)
+      {
+         const int area = l.w * l.h;
+         const int stride = area * (l.classes + 5);
+         int count = first;
+         for (int n = 0; n < l.n; ++n)
+         {
+            const float *anchor = output + n * stride;
+            const float *objectness = anchor + 4 * area;
+            for (int i = 0; i < area; ++i)
+            {
+               if (objectness[i] <= thresh)
+               {
+                  continue;
+               }
+               detection& det = dets_[count++];
+               det.bbox.x = (i % l.w + anchor[i]) / l.w;
+               det.bbox.y = (i / l.w + anchor[area + i]) / l.h;
+               det.bbox.w = std::exp(anchor[2 * area + i]) * l.biases[2 * l.mask[n]] / netw;
+               det.bbox.h = std::exp(anchor[3 * area + i]) * l.biases[2 * l.mask[n] + 1] / neth;
+               det.objectness = objectness[i];
+               det.classes = l.classes;
+               det.sort_class = 0;
+               const float *scores = anchor + 5 * area + i;
+               for (int c = 0; c < l.classes; ++c)
+               {
+                  float prob = objectness[i] * scores[c * area];
+                  det.prob[c] = prob > thresh ? prob : 0;
+               }
+               for (int c = l.classes; c < classes_; ++c)
+               {
+                  det.prob[c] = 0;
+               }
+            }
+         }
+         return count - first;
+      }
+
+      // correct_yolo_boxes: undoes the letterbox, relative coordinates.
+      void correctBoxes(int count, int width, int height, int netw, int neth)
+      {
+         int newW, newH;
+         if ((float) netw / width < (float) neth / height)
+         {
+            newW = netw;
+            newH = (height * netw) / width;
+         }
+         else
+         {
+            newH = neth;
+            newW = (width * neth) / height;
+         }
+         const float offsetX = (netw - newW) / 2. / netw, scaleX = (float) netw / newW;
+         const float offsetY = (neth - newH) / 2. / neth, scaleY = (float) neth / newH;
+         for (int k = 0; k < count; ++k)
+         {
+            box& b = dets_[k].bbox;
+            b.x = (b.x - offsetX) * scaleX;
+            b.y = (b.y - offsetY) * scaleY;
+            b.w *= scaleX;
+            b.h *= scaleY;
+         }
+      }
+
+      bool direct_;
+      int classes_;
+      std::vector<detection> dets_;
+      std::vector<float> probs_;   // classes_ scores per detection, dets_[k].prob points at row k.
+   };
+}
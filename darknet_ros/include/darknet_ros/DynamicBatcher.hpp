@@ -0,0 +1,123 @@
+/*
+ * DynamicBatcher.hpp
+ *
+ *  Request queue of the offline inference lane. Requests are grouped into
+ *  batches of up to maxBatch items; a batch is released as soon as it is
+ *  full or the oldest request has waited maxWait, so throughput grows with
+ *  the load without an idle request waiting for company.
+ */
+
+#pragma once
+
+   // c++
+   #include <chrono>
+   #include <condition_variable>
+   #include <cstddef>
+   #include <deque>
+   #include <mutex>
+   #include <vector>
+
+namespace darknet_ros
+{
+   template <typename T>
+   class DynamicBatcher
+   {
+      public:
+
+      typedef std::chrono::steady_clock Clock;
+
+      explicit DynamicBatcher(size_t capacity) : capacity_(capacity), closed_(false) {}
+
+      // Never blocks the caller - @return false if the queue is full or closed.
+      bool push(const T& item)
+      {
+         std::lock_guard<std::mutex> lock(mutex_);
+         if (closed_ || items_.size() >= capacity_)
+            return false;
+         Pending pending;
+         pending.item = item;
+         pending.arrival = Clock::now();
+         items_.push_back(pending);
+         changed_.notify_one();
+         return true;
+      }
+
+      // Waits for a batch - @param[out] batch up to maxBatch items, oldest first - @return false if the queue has been closed.
+      template <typename Rep, typename Period>
+      bool popBatch(std::vector<T>& batch, size_t maxBatch, const std::chrono::duration<Rep, Period>& maxWait)
+      {
+         batch.clear();
+         std::unique_lock<std::mutex> lock(mutex_);
+         do
+         {
+            changed_.wait(lock, [this] { return closed_ || !items_.empty(); });
+            if (closed_)
+               return false;
+
+            // The deadline follows the oldest request, later arrivals only fill the batch.
+            Clock::time_point deadline = items_.front().arrival + std::chrono::duration_cast<Clock::duration>(maxWait);
+            changed_.wait_until(lock, deadline, [this, maxBatch] { return closed_ || items_.empty() || items_.size() >= maxBatch; });
+            if (closed_)
+               return false;
+         }
+         while (items_.empty());
+         while (!items_.empty() && batch.size() < maxBatch)
+         {
+            batch.push_back(items_.front().item);
+            items_.pop_front();
+         }
+         return true;
+      }
+
+      // Takes the waiting requests matching pred out of the queue - @return number of requests removed.
+      template <typename Predicate>
+      size_t removeIf(Predicate pred)
+      {
+         std::lock_guard<std::mutex> lock(mutex_);
+         size_t before = items_.size();
+         for (typename std::deque<Pending>::iterator it = items_.begin(); it != items_.end();)
+         {
+            if (pred(it->item))
+               it = items_.erase(it);
+            else
+               ++it;
+         }
+         changed_.notify_one();
+         return before - items_.size();
+      }
+
+      // Wakes the consumer, all later calls fail.
+      void close()
+      {
+         std::lock_guard<std::mutex> lock(mutex_);
+         closed_ = true;
+         changed_.notify_all();
+      }
+
+      // Number of requests waiting for a batch.
+      size_t size() const
+      {
+         std::lock_guard<std::mutex> lock(mutex_);
+         return items_.size();
+      }
+
+      size_t capacity() const
+      {
+         return capacity_;
+      }
+
+      private:
+
+      struct Pending
+      {
+         T item;
+         Clock::time_point arrival;
+      };
+
+      const size_t capacity_;
+      bool closed_;
+      std::deque<Pending> items_;
+      mutable std::mutex mutex_;
+      std::condition_variable changed_;
+   };
+}
@@ -0,0 +1,126 @@
+/*
+ * FrameMailbox.hpp
+ *
+ *  Sequence-numbered single-slot mailbox between the camera callback
+ *  and the fetch stage of YoloObjectDetector, one per camera, and the
+ *  signal the fetch stage waits on for any of them.
+ */
+
+#pragma once
+
+   // c++
+   #include <chrono>
+   #include <condition_variable>
+   #include <cstdint>
+   #include <mutex>
+
+namespace darknet_ros
+{
+   // Keeps only the newest frame; the consumer never sees the same frame twice.
+   template <typename Frame>
+   class FrameMailbox
+   {
+      public:
+
+      FrameMailbox() : seq_(0), takenSeq_(0), lastStamp_(0), dropped_(0), duplicates_(0) {}
+
+      // Stores a frame, replacing an unread one - @param[in] stamp 0 disables the duplicate check - @return false if stamp repeats the previous frame.
+      bool post(const Frame& frame, uint64_t stamp)
+      {
+         std::lock_guard<std::mutex> lock(mutex_);
+         if (stamp != 0 && stamp == lastStamp_)
+         {
+            ++duplicates_;
+            return false;
+         }
+         if (seq_ != takenSeq_)
+         {
+            ++dropped_;
+         }
+         frame_ = frame;
+         lastStamp_ = stamp;
+         ++seq_;
+         ready_.notify_all();
+         return true;
+      }
+
+      // Waits for an unread frame and takes it - @return false on timeout.
+      template <typename Rep, typename Period>
+      bool take(Frame& frame, uint64_t& seq, const std::chrono::duration<Rep, Period>& timeout)
+      {
+         std::unique_lock<std::mutex> lock(mutex_);
+         if (!ready_.wait_for(lock, timeout, [this] { return seq_ != takenSeq_; }))
+            return false;
+         frame = frame_;
+         seq = seq_;
+         takenSeq_ = seq_;
+         return true;
+      }
+
+      // Frame counters: accepted, overwritten before being taken, rejected as duplicates.
+      void counters(uint64_t& received, uint64_t& dropped, uint64_t& duplicates) const
+      {
+         std::lock_guard<std::mutex> lock(mutex_);
+         received = seq_;
+         dropped = dropped_;
+         duplicates = duplicates_;
+      }
+
+      private:
+
+      Frame frame_;
+      uint64_t seq_;
+      uint64_t takenSeq_;
+      uint64_t lastStamp_;
+      uint64_t dropped_;
+      uint64_t duplicates_;
+      mutable std::mutex mutex_;
+      std::condition_variable ready_;
+   };
+
+   // Counts posts to any number of mailboxes, so one consumer can wait for all of them.
+   class FrameSignal
+   {
+      public:
+
+      FrameSignal() : count_(0), closed_(false) {}
+
+      void notify()
+      {
+         std::lock_guard<std::mutex> lock(mutex_);
+         ++count_;
+         ready_.notify_all();
+      }
+
+      uint64_t count() const
+      {
+         std::lock_guard<std::mutex> lock(mutex_);
+         return count_;
+      }
+
+      // Waits until notify() is called after seen was read, then updates seen - @return false on timeout or close.
+      template <typename Rep, typename Period>
+      bool wait(uint64_t& seen, const std::chrono::duration<Rep, Period>& timeout)
+      {
+         std::unique_lock<std::mutex> lock(mutex_);
+         if (!ready_.wait_for(lock, timeout, [this, &seen] { return closed_ || count_ != seen; }) || closed_)
+            return false;
+         seen = count_;
+         return true;
+      }
+
+      void close()
+      {
+         std::lock_guard<std::mutex> lock(mutex_);
+         closed_ = true;
+         ready_.notify_all();
+      }
+
+      private:
+
+      uint64_t count_;
+      bool closed_;
+      mutable std::mutex mutex_;
+      std::condition_variable ready_;
+   };
+}
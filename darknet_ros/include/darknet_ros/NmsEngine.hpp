@@ -0,0 +1,419 @@
+/*
+ * NmsEngine.hpp
+ *
+ *  Non-maximum suppression of darknet detections. Candidates are filtered
+ *  by score first and suppressed per class (or across classes) in score
+ *  order. A candidate is only tested against the boxes already kept, with
+ *  a vectorized IoU kernel; once many boxes are kept a uniform grid limits
+ *  the test to the kept boxes sharing a cell with the candidate. Soft-NMS
+ *  decays the scores with a Gaussian of the IoU instead of removing boxes.
+ *  NMS_DARKNET keeps the upstream do_nms_obj.
+ */
+
+#pragma once
+
+   // c++
+   #include <algorithm>
+   #include <cmath>
+   #include <cstddef>
+   #include <vector>
+
+   #if defined(__SSE2__)
+   #include <emmintrin.h>
+   #elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+   #include <arm_neon.h>
+   #endif
+
+extern "C"
+{
+   #include "box.h"
+}
+
+namespace darknet_ros
+{
+   enum NmsMode
+   {
+      NMS_DARKNET,    // do_nms_obj: objectness order, a suppressed box loses every class.
+      NMS_CLASS,      // Boxes only suppress boxes of the same class.
+      NMS_AGNOSTIC    // Boxes ordered by their best class suppress each other whatever the class.
+   };
+
+   // Corner boxes as a structure of arrays, the layout the IoU kernels read.
+   struct NmsBoxes
+   {
+      std::vector<float> x1, y1, x2, y2, area;
+
+      void clear()
+      {
+         x1.clear();
+         y1.clear();
+         x2.clear();
+         y2.clear();
+         area.clear();
+      }
+
+      void push(float bx1, float by1, float bx2, float by2)
+      {
+         x1.push_back(bx1);
+         y1.push_back(by1);
+         x2.push_back(bx2);
+         y2.push_back(by2);
+         area.push_back((bx2 - bx1) * (by2 - by1));
+      }
+
+      size_t size() const
+      {
+         return x1.size();
+      }
+   };
+
+   // @return true if a box in [begin, end) of boxes overlaps b with an IoU above thresh.
+   inline bool anyIouAbove(const NmsBoxes& boxes, size_t begin, size_t end, float bx1, float by1, float bx2, float by2, float thresh)
+   {
+      const float barea = (bx2 - bx1) * (by2 - by1);
+      size_t i = begin;
+      // inter > thresh * union avoids the division.
+#if defined(__SSE2__)
+      const __m128 vx1 = _mm_set1_ps(bx1), vy1 = _mm_set1_ps(by1), vx2 = _mm_set1_ps(bx2), vy2 = _mm_set1_ps(by2);
+      const __m128 varea = _mm_set1_ps(barea), vthresh = _mm_set1_ps(thresh), zero = _mm_setzero_ps();
+      for (; i + 4 <= end; i += 4)
+      {
+         __m128 iw = _mm_max_ps(_mm_sub_ps(_mm_min_ps(vx2, _mm_loadu_ps(&boxes.x2[i])), _mm_max_ps(vx1, _mm_loadu_ps(&boxes.x1[i]))), zero);
+         __m128 ih = _mm_max_ps(_mm_sub_ps(_mm_min_ps(vy2, _mm_loadu_ps(&boxes.y2[i])), _mm_max_ps(vy1, _mm_loadu_ps(&boxes.y1[i]))), zero);
+         __m128 inter = _mm_mul_ps(iw, ih);
+         __m128 uni = _mm_sub_ps(_mm_add_ps(varea, _mm_loadu_ps(&boxes.area[i])), inter);
+         if (_mm_movemask_ps(_mm_cmpgt_ps(inter, _mm_mul_ps(vthresh, uni))))
+            return true;
+      }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+      const float32x4_t vx1 = vdupq_n_f32(bx1), vy1 = vdupq_n_f32(by1), vx2 = vdupq_n_f32(bx2), vy2 = vdupq_n_f32(by2);
+      const float32x4_t varea = vdupq_n_f32(barea), vthresh = vdupq_n_f32(thresh), zero = vdupq_n_f32(0.f);
+      for (; i + 4 <= end; i += 4)
+      {
+         float32x4_t iw = vmaxq_f32(vsubq_f32(vminq_f32(vx2, vld1q_f32(&boxes.x2[i])), vmaxq_f32(vx1, vld1q_f32(&boxes.x1[i]))), zero);
+         float32x4_t ih = vmaxq_f32(vsubq_f32(vminq_f32(vy2, vld1q_f32(&boxes.y2[i])), vmaxq_f32(vy1, vld1q_f32(&boxes.y1[i]))), zero);
+         float32x4_t inter = vmulq_f32(iw, ih);
+         float32x4_t uni = vsubq_f32(vaddq_f32(varea, vld1q_f32(&boxes.area[i])), inter);
+         uint32x4_t above = vcgtq_f32(inter, vmulq_f32(vthresh, uni));
+         uint32x2_t folded = vorr_u32(vget_low_u32(above), vget_high_u32(above));
+         if (vget_lane_u32(folded, 0) | vget_lane_u32(folded, 1))
+            return true;
+      }
+#endif
+      for (; i < end; ++i)
+      {
+         float iw = std::max(std::min(bx2, boxes.x2[i]) - std::max(bx1, boxes.x1[i]), 0.f);
+         float ih = std::max(std::min(by2, boxes.y2[i]) - std::max(by1, boxes.y1[i]), 0.f);
+         float inter = iw * ih;
+         if (inter > thresh * (barea + boxes.area[i] - inter))
+            return true;
+      }
+      return false;
+   }
+
+   // IoU of b with every box in [begin, end) of boxes - @param[out] iou end - begin values.
+   inline void computeIou(const NmsBoxes& boxes, size_t begin, size_t end, float bx1, float by1, float bx2, float by2, float *iou)
+   {
+      const float barea = (bx2 - bx1) * (by2 - by1);
+      size_t i = begin;
+#if defined(__SSE2__)
+      const __m128 vx1 = _mm_set1_ps(bx1), vy1 = _mm_set1_ps(by1), vx2 = _mm_set1_ps(bx2), vy2 = _mm_set1_ps(by2);
+      const __m128 varea = _mm_set1_ps(barea), zero = _mm_setzero_ps(), tiny = _mm_set1_ps(1e-12f);
+      for (; i + 4 <= end; i += 4)
+      {
+         __m128 iw = _mm_max_ps(_mm_sub_ps(_mm_min_ps(vx2, _mm_loadu_ps(&boxes.x2[i])), _mm_max_ps(vx1, _mm_loadu_ps(&boxes.x1[i]))), zero);
+         __m128 ih = _mm_max_ps(_mm_sub_ps(_mm_min_ps(vy2, _mm_loadu_ps(&boxes.y2[i])), _mm_max_ps(vy1, _mm_loadu_ps(&boxes.y1[i]))), zero);
+         __m128 inter = _mm_mul_ps(iw, ih);
+         __m128 uni = _mm_max_ps(_mm_sub_ps(_mm_add_ps(varea, _mm_loadu_ps(&boxes.area[i])), inter), tiny);
+         _mm_storeu_ps(iou + (i - begin), _mm_div_ps(inter, uni));
+      }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+      const float32x4_t vx1 = vdupq_n_f32(bx1), vy1 = vdupq_n_f32(by1), vx2 = vdupq_n_f32(bx2), vy2 = vdupq_n_f32(by2);
+      const float32x4_t varea = vdupq_n_f32(barea), zero = vdupq_n_f32(0.f), tiny = vdupq_n_f32(1e-12f);
+      for (; i + 4 <= end; i += 4)
+      {
+         float32x4_t iw = vmaxq_f32(vsubq_f32(vminq_f32(vx2, vld1q_f32(&boxes.x2[i])), vmaxq_f32(vx1, vld1q_f32(&boxes.x1[i]))), zero);
+         float32x4_t ih = vmaxq_f32(vsubq_f32(vminq_f32(vy2, vld1q_f32(&boxes.y2[i])), vmaxq_f32(vy1, vld1q_f32(&boxes.y1[i]))), zero);
+         float32x4_t inter = vmulq_f32(iw, ih);
+         float32x4_t uni = vmaxq_f32(vsubq_f32(vaddq_f32(varea, vld1q_f32(&boxes.area[i])), inter), tiny);
+         // Two Newton steps on the reciprocal estimate are plenty for a decay factor.
+         float32x4_t r = vrecpeq_f32(uni);
+         r = vmulq_f32(r, vrecpsq_f32(uni, r));
+         r = vmulq_f32(r, vrecpsq_f32(uni, r));
+         vst1q_f32(iou + (i - begin), vmulq_f32(inter, r));
+      }
+#endif
+      for (; i < end; ++i)
+      {
+         float iw = std::max(std::min(bx2, boxes.x2[i]) - std::max(bx1, boxes.x1[i]), 0.f);
+         float ih = std::max(std::min(by2, boxes.y2[i]) - std::max(by1, boxes.y1[i]), 0.f);
+         float inter = iw * ih;
+         iou[i - begin] = inter / std::max(barea + boxes.area[i] - inter, 1e-12f);
+      }
+   }
+
+   // One engine per thread, the scratch buffers are reused from call to call.
+   class NmsEngine
+   {
+      public:
+
+      NmsEngine() : mode_(NMS_CLASS), iouThreshold_(.4f), soft_(false), softSigma_(.5f), queryId_(0) {}
+
+      // @param[in] soft Gaussian score decay with softSigma instead of removing boxes, ignored by NMS_DARKNET.
+      void configure(NmsMode mode, float iouThreshold, bool soft, float softSigma)
+      {
+         mode_ = mode;
+         iouThreshold_ = iouThreshold;
+         soft_ = soft;
+         softSigma_ = std::max(softSigma, 1e-3f);
+      }
+
+      // Suppresses in place by zeroing (or decaying) dets[i].prob - @param[in] scoreThreshold scores at or below it are no candidates.
+      void apply(detection *dets, int nboxes, int classes, float scoreThreshold)
+      {
+         if (mode_ == NMS_DARKNET)
+         {
+            do_nms_obj(dets, nboxes, classes, iouThreshold_);
+            return;
+         }
+
+         // Threshold filter, then group the candidates by class with a counting sort.
+         const int groups = mode_ == NMS_AGNOSTIC ? 1 : classes;
+         candidates_.clear();
+         for (int i = 0; i < nboxes; ++i)
+         {
+            if (mode_ == NMS_AGNOSTIC)
+            {
+               int best = 0;
+               for (int c = 1; c < classes; ++c)
+                  if (dets[i].prob[c] > dets[i].prob[best])
+                     best = c;
+               if (classes > 0 && dets[i].prob[best] > scoreThreshold)
+                  candidates_.push_back(Candidate(i, best, 0, dets[i].prob[best]));
+            }
+            else
+            {
+               for (int c = 0; c < classes; ++c)
+                  if (dets[i].prob[c] > scoreThreshold)
+                     candidates_.push_back(Candidate(i, c, c, dets[i].prob[c]));
+            }
+         }
+         groupOffsets_.assign(groups + 1, 0);
+         for (size_t k = 0; k < candidates_.size(); ++k)
+            ++groupOffsets_[candidates_[k].group + 1];
+         for (int g = 0; g < groups; ++g)
+            groupOffsets_[g + 1] += groupOffsets_[g];
+         sorted_.resize(candidates_.size());
+         fill_ = groupOffsets_;
+         for (size_t k = 0; k < candidates_.size(); ++k)
+            sorted_[fill_[candidates_[k].group]++] = candidates_[k];
+
+         for (int g = 0; g < groups; ++g)
+         {
+            size_t begin = groupOffsets_[g], end = groupOffsets_[g + 1];
+            if (end - begin < 2)
+               continue;
+            std::sort(sorted_.begin() + begin, sorted_.begin() + end, [](const Candidate& a, const Candidate& b) { return a.score > b.score; });
+            if (soft_)
+               suppressSoft(dets, classes, begin, end, scoreThreshold);
+            else
+               suppressHard(dets, classes, begin, end);
+         }
+      }
+
+      private:
+
+      struct Candidate
+      {
+         Candidate() {}
+         Candidate(int box_, int classId_, int group_, float score_) : box(box_), classId(classId_), group(group_), score(score_), seen(0) {}
+         int box;
+         int classId;
+         int group;
+         float score;
+         size_t seen;   // Soft-NMS: kept boxes the score has been decayed by.
+      };
+
+      // Kept boxes before the grid pays off.
+      static const size_t kGridThreshold = 32;
+      static const int kGridSize = 16;
+
+      static void corners(const detection& det, float& x1, float& y1, float& x2, float& y2)
+      {
+         x1 = det.bbox.x - det.bbox.w / 2;
+         y1 = det.bbox.y - det.bbox.h / 2;
+         x2 = det.bbox.x + det.bbox.w / 2;
+         y2 = det.bbox.y + det.bbox.h / 2;
+      }
+
+      void suppress(detection& det, const Candidate& candidate, int classes, float factor)
+      {
+         if (mode_ == NMS_AGNOSTIC)
+         {
+            for (int c = 0; c < classes; ++c)
+               det.prob[c] *= factor;
+         }
+         else
+         {
+            det.prob[candidate.classId] *= factor;
+         }
+      }
+
+      // Greedy NMS of the sorted candidates [begin, end).
+      void suppressHard(detection *dets, int classes, size_t begin, size_t end)
+      {
+         kept_.clear();
+         clearGrid();
+         for (size_t k = begin; k < end; ++k)
+         {
+            float x1, y1, x2, y2;
+            corners(dets[sorted_[k].box], x1, y1, x2, y2);
+            if (overlapsKept(x1, y1, x2, y2))
+            {
+               suppress(dets[sorted_[k].box], sorted_[k], classes, 0.f);
+               continue;
+            }
+            kept_.push(x1, y1, x2, y2);
+            if (kept_.size() == kGridThreshold)
+            {
+               for (size_t i = 0; i < kept_.size(); ++i)
+                  insertGrid(i);
+            }
+            else if (kept_.size() > kGridThreshold)
+            {
+               insertGrid(kept_.size() - 1);
+            }
+         }
+      }
+
+      bool overlapsKept(float x1, float y1, float x2, float y2)
+      {
+         if (kept_.size() < kGridThreshold)
+            return anyIouAbove(kept_, 0, kept_.size(), x1, y1, x2, y2, iouThreshold_);
+
+         // Overlapping boxes share a cell, gather the kept boxes of the candidate's cells once each.
+         int cx1, cy1, cx2, cy2;
+         cellRange(x1, y1, x2, y2, cx1, cy1, cx2, cy2);
+         ++queryId_;
+         query_.clear();
+         for (int cy = cy1; cy <= cy2; ++cy)
+         {
+            for (int cx = cx1; cx <= cx2; ++cx)
+            {
+               const std::vector<int>& cell = grid_[cy * kGridSize + cx];
+               for (size_t j = 0; j < cell.size(); ++j)
+               {
+                  int i = cell[j];
+                  if (stamp_[i] != queryId_)
+                  {
+                     stamp_[i] = queryId_;
+                     query_.push(kept_.x1[i], kept_.y1[i], kept_.x2[i], kept_.y2[i]);
+                  }
+               }
+            }
+         }
+         return anyIouAbove(query_, 0, query_.size(), x1, y1, x2, y2, iouThreshold_);
+      }
+
+      // Exact soft-NMS with lazy rescoring: decays only lower scores, so the best candidate whose
+      // score is up to date with every kept box is the next one kept.
+      void suppressSoft(detection *dets, int classes, size_t begin, size_t end, float scoreThreshold)
+      {
+         kept_.clear();
+         heap_.assign(sorted_.begin() + begin, sorted_.begin() + end);
+         const HeapOrder order;
+         std::make_heap(heap_.begin(), heap_.end(), order);
+         while (!heap_.empty())
+         {
+            std::pop_heap(heap_.begin(), heap_.end(), order);
+            Candidate candidate = heap_.back();
+            heap_.pop_back();
+            detection& det = dets[candidate.box];
+            float x1, y1, x2, y2;
+            corners(det, x1, y1, x2, y2);
+            if (candidate.seen < kept_.size())
+            {
+               iou_.resize(kept_.size() - candidate.seen);
+               computeIou(kept_, candidate.seen, kept_.size(), x1, y1, x2, y2, &iou_[0]);
+               float decay = 0;
+               for (size_t i = 0; i < iou_.size(); ++i)
+                  decay += iou_[i] * iou_[i];
+               float score = candidate.score * std::exp(-decay / softSigma_);
+               candidate.seen = kept_.size();
+               if (score <= scoreThreshold)
+               {
+                  suppress(det, candidate, classes, 0.f);
+                  continue;
+               }
+               suppress(det, candidate, classes, score / candidate.score);
+               candidate.score = score;
+               heap_.push_back(candidate);
+               std::push_heap(heap_.begin(), heap_.end(), order);
+               continue;
+            }
+            kept_.push(x1, y1, x2, y2);
+         }
+      }
+
+      struct HeapOrder
+      {
+         bool operator()(const Candidate& a, const Candidate& b) const
+         {
+            return a.score < b.score;
+         }
+      };
+
+      void cellRange(float x1, float y1, float x2, float y2, int& cx1, int& cy1, int& cx2, int& cy2) const
+      {
+         // Relative coordinates; boxes reaching outside the image land in the border cells.
+         cx1 = std::min(std::max((int) std::floor(x1 * kGridSize), 0), kGridSize - 1);
+         cy1 = std::min(std::max((int) std::floor(y1 * kGridSize), 0), kGridSize - 1);
+         cx2 = std::min(std::max((int) std::floor(x2 * kGridSize), 0), kGridSize - 1);
+         cy2 = std::min(std::max((int) std::floor(y2 * kGridSize), 0), kGridSize - 1);
+      }
+
+      void insertGrid(size_t i)
+      {
+         if (grid_.empty())
+            grid_.resize(kGridSize * kGridSize);
+         if (stamp_.size() <= i)
+            stamp_.resize(std::max<size_t>(2 * i, 64), 0);
+         int cx1, cy1, cx2, cy2;
+         cellRange(kept_.x1[i], kept_.y1[i], kept_.x2[i], kept_.y2[i], cx1, cy1, cx2, cy2);
+         for (int cy = cy1; cy <= cy2; ++cy)
+         {
+            for (int cx = cx1; cx <= cx2; ++cx)
+            {
+               std::vector<int>& cell = grid_[cy * kGridSize + cx];
+               if (cell.empty())
+                  usedCells_.push_back(cy * kGridSize + cx);
+               cell.push_back(i);
+            }
+         }
+      }
+
+      void clearGrid()
+      {
+         for (size_t k = 0; k < usedCells_.size(); ++k)
+            grid_[usedCells_[k]].clear();
+         usedCells_.clear();
+      }
+
+      NmsMode mode_;
+      float iouThreshold_;
+      bool soft_;
+      float softSigma_;
+      std::vector<Candidate> candidates_;
+      std::vector<Candidate> sorted_;
+      std::vector<Candidate> heap_;
+      std::vector<size_t> groupOffsets_;
+      std::vector<size_t> fill_;
+      NmsBoxes kept_;
+      NmsBoxes query_;
+      std::vector<float> iou_;
+      std::vector<std::vector<int> > grid_;
+      std::vector<int> usedCells_;
+      std::vector<unsigned> stamp_;
+      unsigned queryId_;
+   };
+}
@@ -0,0 +1,160 @@
+/*
+ * OverlayRenderer.hpp
+ *
+ *  Draws detection boxes, labels and the image axes the pose is estimated
+ *  from straight into a BGR8 cv::Mat. Lines are written as row spans and
+ *  labels come from a compiled-in 5x7 font, scaled by whole pixels, so
+ *  nothing is loaded at startup and a frame costs a copy plus the pixels
+ *  that change.
+ */
+
+#pragma once
+
+   // c++
+   #include <algorithm>
+   #include <cstring>
+   #include <stdint.h>
+
+   // OpenCV
+   #include <opencv2/core/core.hpp>
+
+namespace darknet_ros
+{
+   enum RenderMode
+   {
+      RENDER_OVERLAY,   // OverlayRenderer.
+      RENDER_OPENCV     // cv::rectangle and cv::putText.
+   };
+
+   class OverlayRenderer
+   {
+      public:
+
+      static const int kGlyphWidth = 5;
+      static const int kGlyphHeight = 7;
+
+      OverlayRenderer() : thickness_(1), scale_(1) {}
+
+      // Copies src into canvas, which keeps its allocation between frames of the same size, and sizes lines and glyphs from the height.
+      void begin(const cv::Mat& src, cv::Mat& canvas)
+      {
+         src.copyTo(canvas);
+         thickness_ = std::max((int) (canvas.rows * .006), 1);
+         scale_ = std::max(canvas.rows / 240, 1);
+      }
+
+      // Box outline of the current thickness, clipped to the canvas.
+      void drawBox(cv::Mat& canvas, int xmin, int ymin, int xmax, int ymax, const uint8_t colour[3]) const
+      {
+         fillRect(canvas, xmin, ymin, xmax + 1, ymin + thickness_, colour);
+         fillRect(canvas, xmin, ymax + 1 - thickness_, xmax + 1, ymax + 1, colour);
+         fillRect(canvas, xmin, ymin, xmin + thickness_, ymax + 1, colour);
+         fillRect(canvas, xmax + 1 - thickness_, ymin, xmax + 1, ymax + 1, colour);
+      }
+
+      // Text in black on a bar of colour, above (x, y) when it fits, otherwise just below y, inside the box (as darknet's draw_label).
+      void drawLabel(cv::Mat& canvas, int x, int y, const char *text, const uint8_t colour[3]) const
+      {
+         static const uint8_t black[3] = {0, 0, 0};
+         const int advance = (kGlyphWidth + 1) * scale_;
+         const int height = (kGlyphHeight + 2) * scale_;
+         int length = strlen(text);
+         int top = y - height >= 0 ? y - height : y;
+         fillRect(canvas, x, top, x + length * advance + scale_, top + height, colour);
+         for (int k = 0; k < length; ++k)
+         {
+            unsigned char c = text[k];
+            if (c < 32 || c > 126)
+               c = '?';
+            const uint8_t *glyph = font()[c - 32];
+            int gx = x + scale_ + k * advance;
+            for (int col = 0; col < kGlyphWidth; ++col)
+            {
+               for (int row = 0; row < kGlyphHeight; ++row)
+               {
+                  if (glyph[col] & (1 << row))
+                  {
+                     int px = gx + col * scale_;
+                     int py = top + scale_ + row * scale_;
+                     fillRect(canvas, px, py, px + scale_, py + scale_, black);
+                  }
+               }
+            }
+         }
+      }
+
+      // The x (red) and y (green) image axes the pose stage samples the depth along: from the box centre to 3/4 of its width and height.
+      void drawAxes(cv::Mat& canvas, int xmin, int ymin, int xmax, int ymax) const
+      {
+         static const uint8_t red[3] = {0, 0, 255};
+         static const uint8_t green[3] = {0, 255, 0};
+         int u = xmax - xmin;
+         int v = ymax - ymin;
+         int cx = xmin + u / 2;
+         int cy = ymin + v / 2;
+         int half = thickness_ / 2;
+         fillRect(canvas, cx, cy - half, xmin + 3 * u / 4 + 1, cy - half + thickness_, red);
+         fillRect(canvas, cx - half, cy, cx - half + thickness_, ymin + 3 * v / 4 + 1, green);
+      }
+
+      private:
+
+      // Fills [x0, x1) x [y0, y1) clipped to the canvas, one row span at a time.
+      static void fillRect(cv::Mat& canvas, int x0, int y0, int x1, int y1, const uint8_t colour[3])
+      {
+         x0 = std::max(x0, 0);
+         y0 = std::max(y0, 0);
+         x1 = std::min(x1, canvas.cols);
+         y1 = std::min(y1, canvas.rows);
+         if (x0 >= x1 || y0 >= y1)
+            return;
+         uint8_t *first = canvas.ptr<uint8_t>(y0) + 3 * x0;
+         for (int x = 0; x < x1 - x0; ++x)
+         {
+            first[3 * x + 0] = colour[0];
+            first[3 * x + 1] = colour[1];
+            first[3 * x + 2] = colour[2];
+         }
+         size_t span = 3 * (x1 - x0);
+         for (int y = y0 + 1; y < y1; ++y)
+         {
+            memcpy(canvas.ptr<uint8_t>(y) + 3 * x0, first, span);
+         }
+      }
+
+      // ASCII 32 to 126, one byte per column, bit 0 is the top row.
+      static const uint8_t (*font())[kGlyphWidth]
+      {
+         static const uint8_t glyphs[95][kGlyphWidth] = {
+            {0x00, 0x00, 0x00, 0x00, 0x00}, {0x00, 0x00, 0x5F, 0x00, 0x00}, {0x00, 0x07, 0x00, 0x07, 0x00}, {0x14, 0x7F, 0x14, 0x7F, 0x14},
+            {0x24, 0x2A, 0x7F, 0x2A, 0x12}, {0x23, 0x13, 0x08, 0x64, 0x62}, {0x36, 0x49, 0x55, 0x22, 0x50}, {0x00, 0x05, 0x03, 0x00, 0x00},
+            {0x00, 0x1C, 0x22, 0x41, 0x00}, {0x00, 0x41, 0x22, 0x1C, 0x00}, {0x14, 0x08, 0x3E, 0x08, 0x14}, {0x08, 0x08, 0x3E, 0x08, 0x08},
+            {0x00, 0x50, 0x30, 0x00, 0x00}, {0x08, 0x08, 0x08, 0x08, 0x08}, {0x00, 0x60, 0x60, 0x00, 0x00}, {0x20, 0x10, 0x08, 0x04, 0x02},
+            {0x3E, 0x51, 0x49, 0x45, 0x3E}, {0x00, 0x42, 0x7F, 0x40, 0x00}, {0x42, 0x61, 0x51, 0x49, 0x46}, {0x21, 0x41, 0x45, 0x4B, 0x31},
+            {0x18, 0x14, 0x12, 0x7F, 0x10}, {0x27, 0x45, 0x45, 0x45, 0x39}, {0x3C, 0x4A, 0x49, 0x49, 0x30}, {0x01, 0x71, 0x09, 0x05, 0x03},
+            {0x36, 0x49, 0x49, 0x49, 0x36}, {0x06, 0x49, 0x49, 0x29, 0x1E}, {0x00, 0x36, 0x36, 0x00, 0x00}, {0x00, 0x56, 0x36, 0x00, 0x00},
+            {0x08, 0x14, 0x22, 0x41, 0x00}, {0x14, 0x14, 0x14, 0x14, 0x14}, {0x00, 0x41, 0x22, 0x14, 0x08}, {0x02, 0x01, 0x51, 0x09, 0x06},
+            {0x32, 0x49, 0x79, 0x41, 0x3E}, {0x7E, 0x11, 0x11, 0x11, 0x7E}, {0x7F, 0x49, 0x49, 0x49, 0x36}, {0x3E, 0x41, 0x41, 0x41, 0x22},
+            {0x7F, 0x41, 0x41, 0x22, 0x1C}, {0x7F, 0x49, 0x49, 0x49, 0x41}, {0x7F, 0x09, 0x09, 0x01, 0x01}, {0x3E, 0x41, 0x41, 0x51, 0x32},
+            {0x7F, 0x08, 0x08, 0x08, 0x7F}, {0x00, 0x41, 0x7F, 0x41, 0x00}, {0x20, 0x40, 0x41, 0x3F, 0x01}, {0x7F, 0x08, 0x14, 0x22, 0x41},
+            {0x7F, 0x40, 0x40, 0x40, 0x40}, {0x7F, 0x02, 0x04, 0x02, 0x7F}, {0x7F, 0x04, 0x08, 0x10, 0x7F}, {0x3E, 0x41, 0x41, 0x41, 0x3E},
+            {0x7F, 0x09, 0x09, 0x09, 0x06}, {0x3E, 0x41, 0x51, 0x21, 0x5E}, {0x7F, 0x09, 0x19, 0x29, 0x46}, {0x46, 0x49, 0x49, 0x49, 0x31},
+            {0x01, 0x01, 0x7F, 0x01, 0x01}, {0x3F, 0x40, 0x40, 0x40, 0x3F}, {0x1F, 0x20, 0x40, 0x20, 0x1F}, {0x7F, 0x20, 0x18, 0x20, 0x7F},
+            {0x63, 0x14, 0x08, 0x14, 0x63}, {0x03, 0x04, 0x78, 0x04, 0x03}, {0x61, 0x51, 0x49, 0x45, 0x43}, {0x00, 0x7F, 0x41, 0x41, 0x00},
+            {0x02, 0x04, 0x08, 0x10, 0x20}, {0x00, 0x41, 0x41, 0x7F, 0x00}, {0x04, 0x02, 0x01, 0x02, 0x04}, {0x40, 0x40, 0x40, 0x40, 0x40},
+            {0x00, 0x01, 0x02, 0x04, 0x00}, {0x20, 0x54, 0x54, 0x54, 0x78}, {0x7F, 0x48, 0x44, 0x44, 0x38}, {0x38, 0x44, 0x44, 0x44, 0x20},
+            {0x38, 0x44, 0x44, 0x48, 0x7F}, {0x38, 0x54, 0x54, 0x54, 0x18}, {0x08, 0x7E, 0x09, 0x01, 0x02}, {0x08, 0x14, 0x54, 0x54, 0x3C},
+            {0x7F, 0x08, 0x04, 0x04, 0x78}, {0x00, 0x44, 0x7D, 0x40, 0x00}, {0x20, 0x40, 0x44, 0x3D, 0x00}, {0x00, 0x7F, 0x10, 0x28, 0x44},
+            {0x00, 0x41, 0x7F, 0x40, 0x00}, {0x7C, 0x04, 0x18, 0x04, 0x78}, {0x7C, 0x08, 0x04, 0x04, 0x78}, {0x38, 0x44, 0x44, 0x44, 0x38},
+            {0x7C, 0x14, 0x14, 0x14, 0x08}, {0x08, 0x14, 0x14, 0x18, 0x7C}, {0x7C, 0x08, 0x04, 0x04, 0x08}, {0x48, 0x54, 0x54, 0x54, 0x20},
+            {0x04, 0x3F, 0x44, 0x40, 0x20}, {0x3C, 0x40, 0x40, 0x20, 0x7C}, {0x1C, 0x20, 0x40, 0x20, 0x1C}, {0x3C, 0x40, 0x30, 0x40, 0x3C},
+            {0x44, 0x28, 0x10, 0x28, 0x44}, {0x0C, 0x50, 0x50, 0x50, 0x3C}, {0x44, 0x64, 0x54, 0x4C, 0x44}, {0x00, 0x08, 0x36, 0x41, 0x00},
+            {0x00, 0x00, 0x7F, 0x00, 0x00}, {0x00, 0x41, 0x36, 0x08, 0x00}, {0x08, 0x04, 0x08, 0x10, 0x08}
+         };
+         return glyphs;
+      }
+
+      int thickness_;
+      int scale_;
+   };
+}
@@ -0,0 +1,106 @@
+/*
+ * PredictionAverager.hpp
+ *
+ *  Temporal smoothing of the detection layer outputs of one camera. The
+ *  window mode keeps a ring of the last N predictions and a running sum
+ *  (add the newest, subtract the one it replaces), the exponential mode a
+ *  decaying average, so a frame costs one pass over the outputs whatever
+ *  the window length. Without smoothing (a window of 1, a decay of 1) the
+ *  averager is a pass-through and the live layer outputs are decoded as is.
+ */
+
+#pragma once
+
+   // c++
+   #include <algorithm>
+   #include <cstddef>
+   #include <vector>
+
+namespace darknet_ros
+{
+   enum AveragingMode
+   {
+      AVERAGE_WINDOW,        // Mean of the last N predictions, missing ones count as zero like the upstream demo.
+      AVERAGE_EXPONENTIAL    // average += decay * (prediction - average).
+   };
+
+   class PredictionAverager
+   {
+      public:
+
+      PredictionAverager() : size_(0), window_(1), mode_(AVERAGE_WINDOW), decay_(1), index_(0), frames_(0) {}
+
+      // @param[in] size outputs per prediction - @param[in] window frames averaged in window mode - @param[in] decay weight of the newest prediction in exponential mode.
+      void reset(size_t size, int window, AveragingMode mode, float decay)
+      {
+         size_ = size;
+         window_ = std::max(window, 1);
+         mode_ = mode;
+         decay_ = std::min(std::max(decay, 0.f), 1.f);
+         index_ = 0;
+         frames_ = 0;
+         const bool keep = !passThrough();
+         average_.assign(keep ? size_ : 0, 0.f);
+         sum_.assign(keep && mode_ == AVERAGE_WINDOW ? size_ : 0, 0.);
+         ring_.assign(keep && mode_ == AVERAGE_WINDOW ? size_ * window_ : 0, 0.f);
+      }
+
+      // The average is always the newest prediction - accumulate() and average() must not be used then.
+      bool passThrough() const
+      {
+         return mode_ == AVERAGE_WINDOW ? window_ == 1 : decay_ >= 1.f;
+      }
+
+      // Folds n outputs of the newest prediction, starting at offset, into the average.
+      void accumulate(size_t offset, const float *x, size_t n)
+      {
+         float *average = &average_[offset];
+         if (mode_ == AVERAGE_EXPONENTIAL)
+         {
+            // The first prediction seeds the average instead of decaying from zero.
+            const float decay = frames_ == 0 ? 1.f : decay_;
+            for (size_t i = 0; i < n; ++i)
+               average[i] += decay * (x[i] - average[i]);
+            return;
+         }
+         double *sum = &sum_[offset];
+         float *oldest = &ring_[index_ * size_ + offset];
+         const double scale = 1. / window_;
+         for (size_t i = 0; i < n; ++i)
+         {
+            sum[i] += (double) x[i] - oldest[i];
+            oldest[i] = x[i];
+            average[i] = (float) (sum[i] * scale);
+         }
+      }
+
+      // Marks the newest prediction complete once all its outputs have been accumulated.
+      void advance()
+      {
+         index_ = (index_ + 1) % window_;
+         ++frames_;
+      }
+
+      const float *average() const
+      {
+         return average_.empty() ? 0 : &average_[0];
+      }
+
+      size_t size() const
+      {
+         return size_;
+      }
+
+      private:
+
+      size_t size_;
+      int window_;
+      AveragingMode mode_;
+      float decay_;
+      int index_;
+      unsigned long frames_;
+      std::vector<float> average_;
+      std::vector<double> sum_;    // Double, so adding and subtracting for hours does not drift.
+      std::vector<float> ring_;    // window_ predictions of size_ outputs, index_ is the oldest.
+   };
+}
@@ -0,0 +1,222 @@
+/*
+ * ResultChannel.hpp
+ *
+ *  Shared-memory ring of per-frame detection results. The detector writes one
+ *  record per frame, readers on the same machine get a torn-free snapshot of
+ *  every object of a frame with a single read. Depends only on POSIX, so the
+ *  reader can be built into consumers that do not use ROS.
+ */
+
+#pragma once
+
+   // c++
+   #include <atomic>
+   #include <cstdint>
+   #include <cstring>
+   #include <string>
+
+   // POSIX
+   #include <fcntl.h>
+   #include <sys/mman.h>
+   #include <sys/stat.h>
+   #include <unistd.h>
+
+namespace darknet_ros
+{
+   static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "The result channel needs lock-free 64 bit atomics.");
+
+   const uint32_t kResultChannelMagic = 0x44524f53;   // "DROS"
+   const uint32_t kResultChannelVersion = 1;
+   const uint32_t kResultChannelSlots = 16;
+   const uint32_t kResultChannelMaxObjects = 32;
+
+   // Object flags.
+   const uint32_t kObjectPositionValid = 1u << 0;
+
+   // Pose of one detected object, positions in metres in the camera frame.
+   struct ObjectPoseRecord
+   {
+      int32_t classId;
+      uint32_t flags;
+      float confidence;
+      float position[3];      // Box centre ray at the colour-masked depth of the box, zero unless kObjectPositionValid.
+      float orientation[4];   // Quaternion x, y, z, w.
+      float centre[3];        // Depth at the box centre.
+      float plate[4];         // detect_plate tracker point x, y, z and its theta.
+   };
+
+   // All objects detected in one frame.
+   struct ResultFrameRecord
+   {
+      uint64_t frameSeq;
+      uint64_t stampNs;       // Capture time of the image.
+      uint32_t numObjects;
+      uint32_t camera;        // Index of the camera in subscribers/camera_streams/namespaces.
+      ObjectPoseRecord objects[kResultChannelMaxObjects];
+   };
+
+   // Shared memory layout: frames are written round-robin, each slot guarded by a seqlock.
+   struct ResultChannelLayout
+   {
+      uint32_t magic;
+      uint32_t version;
+      uint32_t numSlots;
+      uint32_t maxObjects;
+      std::atomic<uint64_t> frames;   // Number of frames written so far.
+      struct Slot
+      {
+         std::atomic<uint64_t> seq;   // Odd while the slot is being written.
+         uint64_t index;              // Channel frame number held by the slot.
+         ResultFrameRecord record;
+      }
+      slots[kResultChannelSlots];
+   };
+
+   // Single writer, owned by the detector.
+   class ResultChannelWriter
+   {
+      public:
+
+      ResultChannelWriter() : layout_(0) {}
+
+      ~ResultChannelWriter()
+      {
+         if (layout_)
+            munmap(layout_, sizeof(ResultChannelLayout));
+      }
+
+      // Creates or reuses the shared memory object - @param[in] name e.g. "/darknet_ros_results" - @return true if successful.
+      bool open(const std::string& name)
+      {
+         int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+         if (fd < 0)
+            return false;
+         if (ftruncate(fd, sizeof(ResultChannelLayout)) != 0)
+         {
+            close(fd);
+            return false;
+         }
+         void *ptr = mmap(0, sizeof(ResultChannelLayout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+         close(fd);
+         if (ptr == MAP_FAILED)
+            return false;
+         layout_ = static_cast<ResultChannelLayout*>(ptr);
+
+         // Readers ignore the channel until the header matches, so it is written last.
+         layout_->magic = 0;
+         std::atomic_thread_fence(std::memory_order_release);
+         for (uint32_t i = 0; i < kResultChannelSlots; ++i)
+            layout_->slots[i].seq.store(0, std::memory_order_relaxed);
+         layout_->frames.store(0, std::memory_order_relaxed);
+         layout_->version = kResultChannelVersion;
+         layout_->numSlots = kResultChannelSlots;
+         layout_->maxObjects = kResultChannelMaxObjects;
+         std::atomic_thread_fence(std::memory_order_release);
+         layout_->magic = kResultChannelMagic;
+         return true;
+      }
+
+      bool isOpen() const
+      {
+         return layout_ != 0;
+      }
+
+      // Writes one frame into the next slot and makes it the latest.
+      void publish(const ResultFrameRecord& record)
+      {
+         uint64_t frames = layout_->frames.load(std::memory_order_relaxed);
+         ResultChannelLayout::Slot& slot = layout_->slots[frames % kResultChannelSlots];
+         uint64_t seq = slot.seq.load(std::memory_order_relaxed);
+         slot.seq.store(seq + 1, std::memory_order_relaxed);
+         std::atomic_thread_fence(std::memory_order_release);
+         slot.index = frames;
+         std::memcpy(&slot.record, &record, sizeof(ResultFrameRecord));
+         slot.seq.store(seq + 2, std::memory_order_release);
+         layout_->frames.store(frames + 1, std::memory_order_release);
+      }
+
+      private:
+
+      ResultChannelLayout *layout_;
+   };
+
+   // Read-only view of the channel, any number of readers.
+   class ResultChannelReader
+   {
+      public:
+
+      ResultChannelReader() : layout_(0) {}
+
+      ~ResultChannelReader()
+      {
+         if (layout_)
+            munmap(const_cast<ResultChannelLayout*>(layout_), sizeof(ResultChannelLayout));
+      }
+
+      // Maps an existing channel - @return false if it does not exist yet.
+      bool open(const std::string& name)
+      {
+         int fd = shm_open(name.c_str(), O_RDONLY, 0);
+         if (fd < 0)
+            return false;
+         struct stat st;
+         if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(ResultChannelLayout))
+         {
+            close(fd);
+            return false;
+         }
+         void *ptr = mmap(0, sizeof(ResultChannelLayout), PROT_READ, MAP_SHARED, fd, 0);
+         close(fd);
+         if (ptr == MAP_FAILED)
+            return false;
+         layout_ = static_cast<const ResultChannelLayout*>(ptr);
+         return true;
+      }
+
+      // Number of frames the writer has published, 0 until the channel is initialized.
+      uint64_t frames() const
+      {
+         if (!isValid())
+            return 0;
+         return layout_->frames.load(std::memory_order_acquire);
+      }
+
+      // Copies the newest frame - @return false if nothing has been published yet.
+      bool readLatest(ResultFrameRecord& record) const
+      {
+         uint64_t frames = this->frames();
+         return frames > 0 && read(frames - 1, record);
+      }
+
+      // Copies frame number index (0-based) - @return false if it was never written or already overwritten.
+      bool read(uint64_t index, ResultFrameRecord& record) const
+      {
+         if (!isValid())
+            return false;
+         const ResultChannelLayout::Slot& slot = layout_->slots[index % kResultChannelSlots];
+         while (true)
+         {
+            uint64_t frames = layout_->frames.load(std::memory_order_acquire);
+            if (index >= frames || frames - index > kResultChannelSlots)
+               return false;
+            uint64_t before = slot.seq.load(std::memory_order_acquire);
+            if (before & 1)
+               continue;
+            uint64_t held = slot.index;
+            std::memcpy(&record, &slot.record, sizeof(ResultFrameRecord));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) == before)
+               return held == index;
+         }
+      }
+
+      private:
+
+      bool isValid() const
+      {
+         return layout_ && layout_->magic == kResultChannelMagic && layout_->version == kResultChannelVersion;
+      }
+
+      const ResultChannelLayout *layout_;
+   };
+}
@@ -0,0 +1,207 @@
+/*
+ * StageQueue.hpp
+ *
+ *  Lock-free single-producer single-consumer ring, slot ownership and
+ *  timing statistics connecting the long-lived fetch, detect and publish
+ *  stages of YoloObjectDetector.
+ */
+
+#pragma once
+
+   // c++
+   #include <algorithm>
+   #include <atomic>
+   #include <condition_variable>
+   #include <cstddef>
+   #include <cstdint>
+   #include <mutex>
+   #include <thread>
+   #include <vector>
+
+namespace darknet_ros
+{
+   // Bounded FIFO between two pipeline stages, one thread pushes and one thread pops.
+   // Items are handed over with release/acquire on the ring indices; a stage only takes the
+   // mutex to sleep when the ring stays empty (or full) after a short spin.
+   template <typename T>
+   class StageQueue
+   {
+      public:
+
+      explicit StageQueue(size_t capacity)
+          : capacity_(std::max<size_t>(capacity, 1)), items_(capacity_), head_(0), tail_(0), closed_(false), waiters_(0) {}
+
+      // Producer only, never blocks - @return false if the queue is full or closed.
+      bool tryPush(const T& item)
+      {
+         uint64_t tail = tail_.load(std::memory_order_relaxed);
+         if (closed_.load(std::memory_order_acquire) || tail - head_.load(std::memory_order_acquire) >= capacity_)
+            return false;
+         items_[tail % capacity_] = item;
+         tail_.store(tail + 1, std::memory_order_release);
+         wake();
+         return true;
+      }
+
+      // Consumer only, never blocks - @return false if the queue is empty or closed.
+      bool tryPop(T& item)
+      {
+         uint64_t head = head_.load(std::memory_order_relaxed);
+         if (closed_.load(std::memory_order_acquire) || head == tail_.load(std::memory_order_acquire))
+            return false;
+         item = items_[head % capacity_];
+         head_.store(head + 1, std::memory_order_release);
+         wake();
+         return true;
+      }
+
+      // Blocks while the queue is full - @return false if the queue has been closed.
+      bool push(const T& item)
+      {
+         while (!tryPush(item))
+         {
+            if (!await([this] { return tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_acquire) < capacity_; }))
+               return false;
+         }
+         return true;
+      }
+
+      // Blocks until an item is available - @return false if the queue has been closed.
+      bool pop(T& item)
+      {
+         while (!tryPop(item))
+         {
+            if (!await([this] { return head_.load(std::memory_order_relaxed) != tail_.load(std::memory_order_acquire); }))
+               return false;
+         }
+         return true;
+      }
+
+      // Wakes every blocked producer and consumer, all later calls fail.
+      void close()
+      {
+         closed_.store(true, std::memory_order_release);
+         std::lock_guard<std::mutex> lock(mutex_);
+         changed_.notify_all();
+      }
+
+      // Number of items currently waiting in the queue, exact only from the two stage threads.
+      size_t size() const
+      {
+         uint64_t head = head_.load(std::memory_order_acquire);
+         return tail_.load(std::memory_order_acquire) - head;
+      }
+
+      size_t capacity() const
+      {
+         return capacity_;
+      }
+
+      private:
+
+      // Spins briefly, then sleeps until ready() holds - @return false if the queue has been closed.
+      template <typename Ready>
+      bool await(Ready ready)
+      {
+         for (int spin = 0; spin < 64; ++spin)
+         {
+            if (closed_.load(std::memory_order_acquire))
+               return false;
+            if (ready())
+               return true;
+            std::this_thread::yield();
+         }
+         std::unique_lock<std::mutex> lock(mutex_);
+         waiters_.fetch_add(1, std::memory_order_seq_cst);
+         std::atomic_thread_fence(std::memory_order_seq_cst);
+         changed_.wait(lock, [this, &ready] { return closed_.load(std::memory_order_acquire) || ready(); });
+         waiters_.fetch_sub(1, std::memory_order_relaxed);
+         return !closed_.load(std::memory_order_acquire);
+      }
+
+      // Pairs with the fence in await(): either the sleeper sees the new index or we see the sleeper.
+      void wake()
+      {
+         std::atomic_thread_fence(std::memory_order_seq_cst);
+         if (waiters_.load(std::memory_order_relaxed) > 0)
+         {
+            std::lock_guard<std::mutex> lock(mutex_);
+            changed_.notify_all();
+         }
+      }
+
+      const size_t capacity_;
+      std::vector<T> items_;
+      alignas(64) std::atomic<uint64_t> head_;   // Next item to pop, written by the consumer.
+      alignas(64) std::atomic<uint64_t> tail_;   // Next item to push, written by the producer.
+      std::atomic<bool> closed_;
+      std::atomic<int> waiters_;
+      std::mutex mutex_;
+      std::condition_variable changed_;
+   };
+
+   // Which stage holds each slot; a handoff from any stage other than the expected one is a pipeline bug.
+   class SlotOwnership
+   {
+      public:
+
+      explicit SlotOwnership(size_t slots, int initialOwner) : owners_(slots)
+      {
+         for (size_t i = 0; i < slots; ++i)
+            owners_[i].store(initialOwner, std::memory_order_relaxed);
+      }
+
+      // Moves the slot from stage from to stage to - @return false if from did not own it.
+      bool transfer(size_t slot, int from, int to)
+      {
+         return owners_[slot].compare_exchange_strong(from, to, std::memory_order_acq_rel);
+      }
+
+      int owner(size_t slot) const
+      {
+         return owners_[slot].load(std::memory_order_acquire);
+      }
+
+      private:
+
+      std::vector<std::atomic<int> > owners_;
+   };
+
+   // Per-stage latency bookkeeping - wait is time spent queued, service is time spent working.
+   class StageStats
+   {
+      public:
+
+      StageStats() : count_(0), waitAvg_(0), serviceAvg_(0), serviceMax_(0) {}
+
+      // Records one item - @param[in] wait and service in seconds.
+      void record(double wait, double service)
+      {
+         std::lock_guard<std::mutex> lock(mutex_);
+         const double alpha = count_ == 0 ? 1.0 : 0.1;
+         waitAvg_ += alpha * (wait - waitAvg_);
+         serviceAvg_ += alpha * (service - serviceAvg_);
+         serviceMax_ = std::max(serviceMax_, service);
+         ++count_;
+      }
+
+      // Copies the current averages and resets the running maximum.
+      void snapshot(unsigned long& count, double& waitAvg, double& serviceAvg, double& serviceMax)
+      {
+         std::lock_guard<std::mutex> lock(mutex_);
+         count = count_;
+         waitAvg = waitAvg_;
+         serviceAvg = serviceAvg_;
+         serviceMax = serviceMax_;
+         serviceMax_ = 0;
+      }
+
+      private:
+
+      unsigned long count_;
+      double waitAvg_;
+      double serviceAvg_;
+      double serviceMax_;
+      std::mutex mutex_;
+   };
+}
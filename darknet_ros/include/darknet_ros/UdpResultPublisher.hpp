@@ -0,0 +1,260 @@
+/*
+ * UdpResultPublisher.hpp
+ *
+ *  Binary UDP transport of the per-frame detection results to the second
+ *  computer (unicast or multicast). A frame is batched into as few datagrams
+ *  as fit the payload limit. Fields are sent in host byte order, which is
+ *  little-endian on both the Jetson and x86 consumers. Like ResultChannel.hpp
+ *  it depends only on POSIX, so the receiver can be used without ROS.
+ */
+
+#pragma once
+
+   // c++
+   #include <algorithm>
+   #include <cstdint>
+   #include <cstring>
+   #include <string>
+   #include <vector>
+
+   // POSIX
+   #include <arpa/inet.h>
+   #include <netinet/in.h>
+   #include <poll.h>
+   #include <sys/socket.h>
+   #include <time.h>
+   #include <unistd.h>
+
+#include "darknet_ros/ResultChannel.hpp"
+
+namespace darknet_ros
+{
+   const uint32_t kUdpResultMagic = 0x44524f55;   // "DROU"
+   const uint16_t kUdpResultVersion = 1;
+
+   // Datagram header, followed by numObjects ObjectPoseRecords.
+   struct UdpResultHeader
+   {
+      uint32_t magic;
+      uint16_t version;
+      uint16_t headerSize;
+      uint64_t frameSeq;
+      uint64_t stampNs;       // Capture time of the image.
+      uint64_t receiveNs;     // CLOCK_REALTIME when cameraCallback received the image.
+      uint64_t sendNs;        // CLOCK_REALTIME when the datagram was sent.
+      uint16_t fragment;
+      uint16_t fragments;
+      uint16_t numObjects;    // Objects in this datagram.
+      uint16_t totalObjects;  // Objects in the whole frame.
+      uint16_t firstObject;   // Index of the first object of this datagram in the frame.
+      uint16_t camera;        // ResultFrameRecord::camera.
+      uint16_t reserved[2];
+   };
+
+   static_assert(sizeof(UdpResultHeader) == 56, "UdpResultHeader must not contain padding.");
+   static_assert(sizeof(ObjectPoseRecord) == 68, "ObjectPoseRecord must not contain padding.");
+
+   // Datagram payload limits: a header and one object, and the largest IPv4 UDP payload.
+   const size_t kUdpMinDatagram = sizeof(UdpResultHeader) + sizeof(ObjectPoseRecord);
+   const size_t kUdpMaxDatagram = 65507;
+   const uint16_t kUdpMaxFragments = kResultChannelMaxObjects;   // At least one object per fragment.
+   static_assert(kResultChannelMaxObjects <= 32, "UdpResultReceiver tracks fragments in a 32 bit mask.");
+
+   // Nanoseconds of CLOCK_REALTIME, the clock used for the latency fields.
+   inline uint64_t udpResultClockNs()
+   {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+   }
+
+   // Sends one frame per call, never blocks the caller.
+   class UdpResultPublisher
+   {
+      public:
+
+      UdpResultPublisher() : socket_(-1), maxDatagram_(0) {}
+
+      ~UdpResultPublisher()
+      {
+         if (socket_ >= 0)
+            ::close(socket_);
+      }
+
+      // @param[in] address unicast or multicast IPv4 address - @param[in] maxDatagram payload limit in bytes - @return true if successful.
+      bool open(const std::string& address, int port, int multicastTtl, size_t maxDatagram)
+      {
+         memset(&destination_, 0, sizeof(destination_));
+         destination_.sin_family = AF_INET;
+         destination_.sin_port = htons(port);
+         if (inet_pton(AF_INET, address.c_str(), &destination_.sin_addr) != 1)
+            return false;
+         if (maxDatagram < kUdpMinDatagram || maxDatagram > kUdpMaxDatagram)
+            return false;
+
+         socket_ = socket(AF_INET, SOCK_DGRAM, 0);
+         if (socket_ < 0)
+            return false;
+         if (IN_MULTICAST(ntohl(destination_.sin_addr.s_addr)))
+         {
+            unsigned char ttl = multicastTtl;
+            unsigned char loop = 1;
+            setsockopt(socket_, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+            setsockopt(socket_, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+         }
+         maxDatagram_ = maxDatagram;
+         buffer_.resize(maxDatagram_);
+         return true;
+      }
+
+      bool isOpen() const
+      {
+         return socket_ >= 0;
+      }
+
+      // Sends the frame in one or more datagrams - @return false if a datagram could not be queued.
+      bool send(const ResultFrameRecord& record, uint64_t receiveNs)
+      {
+         const size_t perDatagram = (maxDatagram_ - sizeof(UdpResultHeader)) / sizeof(ObjectPoseRecord);
+         const uint32_t total = std::min(record.numObjects, kResultChannelMaxObjects);
+         const uint16_t fragments = std::max<size_t>(1, (total + perDatagram - 1) / perDatagram);
+
+         UdpResultHeader header;
+         header.magic = kUdpResultMagic;
+         header.version = kUdpResultVersion;
+         header.headerSize = sizeof(UdpResultHeader);
+         header.frameSeq = record.frameSeq;
+         header.stampNs = record.stampNs;
+         header.receiveNs = receiveNs;
+         header.fragments = fragments;
+         header.totalObjects = total;
+         header.camera = record.camera;
+         memset(header.reserved, 0, sizeof(header.reserved));
+
+         bool ok = true;
+         for (uint16_t fragment = 0; fragment < fragments; ++fragment)
+         {
+            size_t first = fragment * perDatagram;
+            size_t count = std::min<size_t>(perDatagram, total - first);
+            header.fragment = fragment;
+            header.numObjects = count;
+            header.firstObject = first;
+            header.sendNs = udpResultClockNs();
+            memcpy(&buffer_[0], &header, sizeof(header));
+            memcpy(&buffer_[sizeof(header)], &record.objects[first], count * sizeof(ObjectPoseRecord));
+            size_t size = sizeof(header) + count * sizeof(ObjectPoseRecord);
+            if (sendto(socket_, &buffer_[0], size, MSG_DONTWAIT, (const struct sockaddr*) &destination_, sizeof(destination_)) != (ssize_t) size)
+               ok = false;
+         }
+         return ok;
+      }
+
+      private:
+
+      int socket_;
+      size_t maxDatagram_;
+      struct sockaddr_in destination_;
+      std::vector<unsigned char> buffer_;
+   };
+
+   // Reassembles the frames sent by UdpResultPublisher.
+   class UdpResultReceiver
+   {
+      public:
+
+      UdpResultReceiver() : socket_(-1), pendingSeq_(0), pendingCamera_(0), pendingFragments_(0), receivedMask_(0) {}
+
+      ~UdpResultReceiver()
+      {
+         if (socket_ >= 0)
+            ::close(socket_);
+      }
+
+      // @param[in] multicastGroup empty for unicast - @return true if successful.
+      bool open(int port, const std::string& multicastGroup = std::string())
+      {
+         socket_ = socket(AF_INET, SOCK_DGRAM, 0);
+         if (socket_ < 0)
+            return false;
+         int reuse = 1;
+         setsockopt(socket_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+         struct sockaddr_in local;
+         memset(&local, 0, sizeof(local));
+         local.sin_family = AF_INET;
+         local.sin_port = htons(port);
+         local.sin_addr.s_addr = htonl(INADDR_ANY);
+         if (bind(socket_, (const struct sockaddr*) &local, sizeof(local)) != 0)
+            return false;
+         if (!multicastGroup.empty())
+         {
+            struct ip_mreq request;
+            if (inet_pton(AF_INET, multicastGroup.c_str(), &request.imr_multiaddr) != 1)
+               return false;
+            request.imr_interface.s_addr = htonl(INADDR_ANY);
+            if (setsockopt(socket_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request, sizeof(request)) != 0)
+               return false;
+         }
+         buffer_.resize(65536);
+         return true;
+      }
+
+      // Waits for the next complete frame - @param[out] receiveNs camera receive time of the frame - @return false on timeout.
+      bool receive(ResultFrameRecord& record, uint64_t& receiveNs, int timeoutMs)
+      {
+         struct pollfd fd;
+         fd.fd = socket_;
+         fd.events = POLLIN;
+         while (poll(&fd, 1, timeoutMs) > 0)
+         {
+            ssize_t size = recv(socket_, &buffer_[0], buffer_.size(), 0);
+            UdpResultHeader header;
+            if (size < (ssize_t) sizeof(header))
+               continue;
+            memcpy(&header, &buffer_[0], sizeof(header));
+            if (header.magic != kUdpResultMagic || header.version != kUdpResultVersion || header.headerSize < sizeof(UdpResultHeader)
+                || header.fragments == 0 || header.fragments > kUdpMaxFragments || header.fragment >= header.fragments
+                || header.firstObject + header.numObjects > kResultChannelMaxObjects
+                || size != (ssize_t) (header.headerSize + header.numObjects * sizeof(ObjectPoseRecord)))
+               continue;
+
+            // A fragment of another frame abandons the incomplete one, sequence numbers count per camera.
+            if (header.frameSeq != pendingSeq_ || header.camera != pendingCamera_ || receivedMask_ == 0)
+            {
+               memset(&pending_, 0, sizeof(pending_));
+               pendingSeq_ = header.frameSeq;
+               pendingCamera_ = header.camera;
+               pendingFragments_ = header.fragments;
+               receivedMask_ = 0;
+               pending_.frameSeq = header.frameSeq;
+               pending_.stampNs = header.stampNs;
+               pending_.camera = header.camera;
+               pending_.numObjects = std::min<uint32_t>(header.totalObjects, kResultChannelMaxObjects);
+            }
+            // Duplicates and fragments disagreeing with the frame on their count are dropped, each fragment counts once.
+            uint32_t bit = 1u << header.fragment;
+            if (header.fragments != pendingFragments_ || (receivedMask_ & bit))
+               continue;
+            memcpy(&pending_.objects[header.firstObject], &buffer_[header.headerSize], header.numObjects * sizeof(ObjectPoseRecord));
+            receivedMask_ |= bit;
+            if (receivedMask_ == (pendingFragments_ == 32 ? ~0u : (1u << pendingFragments_) - 1))
+            {
+               record = pending_;
+               receiveNs = header.receiveNs;
+               receivedMask_ = 0;
+               return true;
+            }
+         }
+         return false;
+      }
+
+      private:
+
+      int socket_;
+      std::vector<unsigned char> buffer_;
+      ResultFrameRecord pending_;
+      uint64_t pendingSeq_;
+      uint16_t pendingCamera_;
+      uint16_t pendingFragments_;
+      uint32_t receivedMask_;      // Bit k set once fragment k of the pending frame is in.
+   };
+}
@@ -0,0 +1,276 @@
+/*
+ * WeightCache.hpp
+ *
+ *  Weights of a network laid out in layer order, each array 64 byte
+ *  aligned, as they are in memory after load_weights (transposed connected
+ *  layers included). The file is mapped read-only and shared, the layers
+ *  point straight into the mapping: a restart reads no weights, and every
+ *  detector process mapping the same file uses one physical copy from the
+ *  page cache. The header records the size and modification time of the
+ *  cfg and weights files, a cache built from other files is not used.
+ */
+
+#pragma once
+
+   // c++
+   #include <cstdint>
+   #include <cstdio>
+   #include <cstdlib>
+   #include <cstring>
+   #include <string>
+   #include <vector>
+
+   // POSIX
+   #include <fcntl.h>
+   #include <sys/mman.h>
+   #include <sys/stat.h>
+   #include <unistd.h>
+
+extern "C"
+{
+   #include "network.h"
+}
+
+namespace darknet_ros
+{
+   const char kWeightCacheMagic[8] = {'D', 'K', 'W', 'C', 'A', 'C', 'H', 'E'};
+   const uint32_t kWeightCacheVersion = 1;
+   const uint64_t kWeightCacheAlignment = 64;
+
+   // Files a cache was built from.
+   struct WeightCacheSource
+   {
+      uint64_t cfgSize;
+      int64_t cfgMtime;
+      uint64_t weightsSize;
+      int64_t weightsMtime;
+
+      // @return false if either file cannot be stat'ed.
+      bool read(const char *cfgfile, const char *weightfile)
+      {
+         struct stat cfg, weights;
+         if (stat(cfgfile, &cfg) != 0 || stat(weightfile, &weights) != 0)
+            return false;
+         cfgSize = cfg.st_size;
+         cfgMtime = cfg.st_mtime;
+         weightsSize = weights.st_size;
+         weightsMtime = weights.st_mtime;
+         return true;
+      }
+   };
+
+   struct WeightCacheHeader
+   {
+      char magic[8];
+      uint32_t version;
+      uint32_t layers;
+      WeightCacheSource source;
+      uint64_t seen;      // *net->seen of the weights file.
+      uint64_t arrays;    // WeightCacheEntry records following the header.
+      uint64_t size;      // Whole file, a truncated file is not used.
+   };
+
+   // One weight array: offset from the start of the file, in bytes, and length in floats.
+   struct WeightCacheEntry
+   {
+      uint32_t layer;
+      uint32_t kind;
+      uint64_t offset;
+      uint64_t count;
+   };
+
+   class WeightCache
+   {
+      public:
+
+      WeightCache() : data_(0), size_(0) {}
+
+      // Maps path read-only - @return false if it is missing, truncated or built from other files.
+      bool map(const std::string& path, const WeightCacheSource& source)
+      {
+         int fd = ::open(path.c_str(), O_RDONLY);
+         if (fd < 0)
+            return false;
+         struct stat st;
+         if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(WeightCacheHeader))
+         {
+            close(fd);
+            return false;
+         }
+         void *ptr = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+         close(fd);
+         if (ptr == MAP_FAILED)
+            return false;
+         const WeightCacheHeader *header = static_cast<const WeightCacheHeader*>(ptr);
+         if (memcmp(header->magic, kWeightCacheMagic, sizeof(kWeightCacheMagic)) != 0 || header->version != kWeightCacheVersion
+             || header->size != (uint64_t) st.st_size || memcmp(&header->source, &source, sizeof(source)) != 0
+             || sizeof(WeightCacheHeader) + header->arrays * sizeof(WeightCacheEntry) > (uint64_t) st.st_size)
+         {
+            munmap(ptr, st.st_size);
+            return false;
+         }
+         unmap();
+         data_ = static_cast<const char*>(ptr);
+         size_ = st.st_size;
+         return true;
+      }
+
+      // Points the weight arrays of net, parsed from the same cfg, into the mapping and frees its own - @return false if the layout differs.
+      bool attach(network *net) const
+      {
+         if (!data_)
+            return false;
+         const WeightCacheHeader *header = reinterpret_cast<const WeightCacheHeader*>(data_);
+         const WeightCacheEntry *entries = reinterpret_cast<const WeightCacheEntry*>(header + 1);
+         std::vector<WeightCacheEntry> expected;
+         if (header->layers != (uint32_t) net->n || !layout(net, expected) || expected.size() != header->arrays)
+            return false;
+         for (size_t k = 0; k < expected.size(); ++k)
+         {
+            const WeightCacheEntry& entry = entries[k];
+            if (entry.layer != expected[k].layer || entry.kind != expected[k].kind || entry.count != expected[k].count
+                || entry.offset % kWeightCacheAlignment != 0 || entry.offset + entry.count * sizeof(float) > size_)
+               return false;
+         }
+         // Checked in full before the first layer is touched, so a mismatch leaves net as it was.
+         for (size_t k = 0; k < expected.size(); ++k)
+         {
+            float *&array = slot(net->layers[entries[k].layer], entries[k].kind);
+            free(array);
+            array = reinterpret_cast<float*>(const_cast<char*>(data_ + entries[k].offset));
+         }
+         *net->seen = header->seen;
+         return true;
+      }
+
+      // Writes the weights of net to path through a temporary file and a rename, so readers never map a partial cache.
+      static bool write(const std::string& path, network *net, const WeightCacheSource& source)
+      {
+         std::vector<WeightCacheEntry> entries;
+         if (!layout(net, entries))
+            return false;
+         uint64_t offset = align(sizeof(WeightCacheHeader) + entries.size() * sizeof(WeightCacheEntry));
+         for (size_t k = 0; k < entries.size(); ++k)
+         {
+            entries[k].offset = offset;
+            offset = align(offset + entries[k].count * sizeof(float));
+         }
+
+         WeightCacheHeader header;
+         memset(&header, 0, sizeof(header));
+         memcpy(header.magic, kWeightCacheMagic, sizeof(kWeightCacheMagic));
+         header.version = kWeightCacheVersion;
+         header.layers = net->n;
+         header.source = source;
+         header.seen = *net->seen;
+         header.arrays = entries.size();
+         header.size = offset;
+
+         std::string temporary = path + ".tmp." + std::to_string(getpid());
+         FILE *file = fopen(temporary.c_str(), "wb");
+         if (!file)
+            return false;
+         bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+                   && (entries.empty() || fwrite(&entries[0], sizeof(WeightCacheEntry), entries.size(), file) == entries.size());
+         static const char zeros[kWeightCacheAlignment] = {0};
+         for (size_t k = 0; ok && k < entries.size(); ++k)
+         {
+            long position = ftell(file);
+            ok = position >= 0 && fwrite(zeros, 1, entries[k].offset - position, file) == entries[k].offset - position
+                 && fwrite(slot(net->layers[entries[k].layer], entries[k].kind), sizeof(float), entries[k].count, file) == entries[k].count;
+         }
+         long position = ftell(file);
+         ok = ok && position >= 0 && fwrite(zeros, 1, offset - position, file) == offset - position;
+         ok = (fclose(file) == 0) && ok;
+         if (!ok || rename(temporary.c_str(), path.c_str()) != 0)
+         {
+            unlink(temporary.c_str());
+            return false;
+         }
+         return true;
+      }
+
+      private:
+
+      enum Kind
+      {
+         WEIGHTS,
+         BIASES,
+         SCALES,
+         ROLLING_MEAN,
+         ROLLING_VARIANCE,
+         NUM_KINDS
+      };
+
+      static uint64_t align(uint64_t offset)
+      {
+         return (offset + kWeightCacheAlignment - 1) / kWeightCacheAlignment * kWeightCacheAlignment;
+      }
+
+      static float *&slot(layer& l, uint32_t kind)
+      {
+         switch (kind)
+         {
+            case WEIGHTS: return l.weights;
+            case BIASES: return l.biases;
+            case SCALES: return l.scales;
+            case ROLLING_MEAN: return l.rolling_mean;
+            default: return l.rolling_variance;
+         }
+      }
+
+      // The arrays load_weights fills, layer by layer - @return false for layers keeping weights elsewhere (local, recurrent).
+      static bool layout(network *net, std::vector<WeightCacheEntry>& entries)
+      {
+         entries.clear();
+         for (int i = 0; i < net->n; ++i)
+         {
+            const layer& l = net->layers[i];
+            uint64_t counts[NUM_KINDS] = {0, 0, 0, 0, 0};
+            if (l.type == CONVOLUTIONAL || l.type == DECONVOLUTIONAL)
+            {
+               counts[WEIGHTS] = l.nweights;
+               counts[BIASES] = l.n;
+               if (l.batch_normalize)
+                  counts[SCALES] = counts[ROLLING_MEAN] = counts[ROLLING_VARIANCE] = l.n;
+            }
+            else if (l.type == CONNECTED)
+            {
+               counts[WEIGHTS] = (uint64_t) l.outputs * l.inputs;
+               counts[BIASES] = l.outputs;
+               if (l.batch_normalize)
+                  counts[SCALES] = counts[ROLLING_MEAN] = counts[ROLLING_VARIANCE] = l.outputs;
+            }
+            else if (l.type == BATCHNORM)
+            {
+               counts[SCALES] = counts[ROLLING_MEAN] = counts[ROLLING_VARIANCE] = l.c;
+            }
+            else if (l.type == LOCAL || l.type == RNN || l.type == GRU || l.type == LSTM || l.type == CRNN)
+            {
+               return false;
+            }
+            for (uint32_t kind = 0; kind < NUM_KINDS; ++kind)
+            {
+               if (counts[kind] > 0)
+               {
+                  WeightCacheEntry entry = {(uint32_t) i, kind, 0, counts[kind]};
+                  entries.push_back(entry);
+               }
+            }
+         }
+         return true;
+      }
+
+      void unmap()
+      {
+         if (data_)
+            munmap(const_cast<char*>(data_), size_);
+         data_ = 0;
+         size_ = 0;
+      }
+
+      // Never unmapped once attached, the node does not free its network.
+      const char *data_;
+      size_t size_;
+   };
+}
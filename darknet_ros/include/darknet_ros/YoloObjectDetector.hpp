@@ -15,11 +15,13 @@
 
    // c++
    #include <math.h>
+   #include <atomic>
    #include <string>
    #include <vector>
    #include <iostream>
    #include <pthread.h>   
    #include <thread>
+   #include <mutex>
    #include <chrono>
    #include <stdio.h>                                           //For depth inclussion
    #include <boost/array.hpp>
@@ -30,11 +32,13 @@
    #include <std_msgs/Int8.h>
    #include <std_msgs/String.h>                                  //For depth inclussion
    #include <std_msgs/Float64.h>                                 //For object position publication
-   #include <actionlib/server/simple_action_server.h>   
+   #include <actionlib/server/action_server.h>
    #include <sensor_msgs/image_encodings.h>
    #include <sensor_msgs/Image.h>
+   #include <sensor_msgs/CameraInfo.h>
    #include <geometry_msgs/Point.h>
    #include <image_transport/image_transport.h>
+   #include <image_transport/camera_common.h>
    #include <message_filters/subscriber.h>                       //For depth inclussion
    #include <message_filters/synchronizer.h>                     //For depth inclussion
    #include <message_filters/time_synchronizer.h>                //For depth inclussion
@@ -74,21 +78,64 @@ extern "C"
    #include "box.h"
    #include "darknet_ros/image_interface.h"
    #include <sys/time.h>
+#ifdef GPU
+   #include "convolutional_layer.h"
+   #include "deconvolutional_layer.h"
+   #include "connected_layer.h"
+   #include "batchnorm_layer.h"
+#endif
 }
 
-extern "C" void ipl_into_image(IplImage* src, image im);
-extern "C" image ipl_to_image(IplImage* src);
+#include "darknet_ros/BackProjection.hpp"
+#include "darknet_ros/DepthStatistics.hpp"
+#include "darknet_ros/DetectionBuffer.hpp"
+#include "darknet_ros/DetectionDecoder.hpp"
+#include "darknet_ros/DynamicBatcher.hpp"
+#include "darknet_ros/FrameMailbox.hpp"
+#include "darknet_ros/NmsEngine.hpp"
+#include "darknet_ros/OverlayRenderer.hpp"
+#include "darknet_ros/PredictionAverager.hpp"
+#include "darknet_ros/ResultChannel.hpp"
+#include "darknet_ros/StageQueue.hpp"
+#include "darknet_ros/UdpResultPublisher.hpp"
+#include "darknet_ros/WeightCache.hpp"
+
 extern "C" void show_image_cv(image p, const char *name, IplImage *disp);
 
 namespace darknet_ros
 {
-   // Bounding box of the detected object.
+   // Camera frame handed from the callbacks to the fetch stage.
+   // The images keep the received messages alive, so shared (zero-copy) conversions stay valid.
+   typedef struct
+   {
+      cv_bridge::CvImageConstPtr rgb;
+      cv_bridge::CvImageConstPtr depth;
+      std_msgs::Header header;
+      CameraIntrinsics_ intrinsics;
+      int camera;
+      uint64_t seq;
+      uint64_t receivedNs;
+   }
+   CameraFrame_;
+
+   // One camera's share of a batch.
    typedef struct
    {
-      float x, y, w, h, prob;
-      int num, Class;
+      cv::Mat render;   // BGR8 frame with the boxes, only drawn while someone watches.
+      CameraFrame_ frame;
+      DetectionBuffer detections;
+      bool fresh;   // A new frame of this camera is in the batch.
    }
-   RosBox_;
+   CameraView_;
+
+   // One batch travelling through the fetch -> detect -> publish pipeline.
+   typedef struct
+   {
+      image buffLetter;   // Network input, batch index = camera index.
+      std::vector<CameraView_> views;
+      double queuedTime;
+   }
+   FrameSlot_;
 
    class YoloObjectDetector
    {
@@ -108,24 +155,22 @@ namespace darknet_ros
       // Initialize the ROS connections.
       void init();
 
-      // Callback of camera - @param[in] msg image pointer.
-      void cameraCallback(const sensor_msgs::ImageConstPtr& msg, const sensor_msgs::ImageConstPtr& msgdepth);
-
-      // Check for objects action goal callback.
-      void checkForObjectsActionGoalCB();
+      // Typedefs.
+      typedef actionlib::ActionServer<darknet_ros_msgs::CheckForObjectsAction> CheckForObjectsActionServer;
+      typedef std::shared_ptr<CheckForObjectsActionServer> CheckForObjectsActionServerPtr;
+      typedef CheckForObjectsActionServer::GoalHandle CheckForObjectsGoalHandle;
 
-      // Check for objects action preempt callback.
-      void checkForObjectsActionPreemptCB();
+      // Callback of camera - @param[in] msg image pointer - @param[in] camera index of the stream.
+      void cameraCallback(const sensor_msgs::ImageConstPtr& msg, const sensor_msgs::ImageConstPtr& msgdepth, const sensor_msgs::CameraInfoConstPtr& info, int camera);
 
-      // Check if a preempt for the check for objects action has been requested - @return false if preempt has been requested or inactive.
-      bool isCheckingForObjects() const;
+      // Check for objects action goal callback - @param[in] goal queued for the offline lane.
+      void checkForObjectsActionGoalCB(CheckForObjectsGoalHandle goal);
 
-      // Publishes the detection image - @return true if successful.
-      bool publishDetectionImage(const cv::Mat& detectionImage);
+      // Check for objects action cancel callback.
+      void checkForObjectsActionCancelCB(CheckForObjectsGoalHandle goal);
 
-      // Typedefs.
-      typedef actionlib::SimpleActionServer<darknet_ros_msgs::CheckForObjectsAction> CheckForObjectsActionServer;
-      typedef std::shared_ptr<CheckForObjectsActionServer> CheckForObjectsActionServerPtr;
+      // Publishes the detection image of a camera - @return true if successful.
+      bool publishDetectionImage(const cv::Mat& detectionImage, ros::Publisher& publisher);
 
       // ROS node handle.
       ros::NodeHandle nodeHandle_;
@@ -140,56 +185,116 @@ namespace darknet_ros
       // Advertise and subscribe to image topics.
       image_transport::ImageTransport imageTransport_;
 
-      // ROS subscriber and publisher.
-      image_transport::Subscriber imageSubscriber_;
-      ros::Publisher objectPublisher_;
-      ros::Publisher boundingBoxesPublisher_;
-
       // Syncronizing Image messages - For depth inclussion
       typedef image_transport::SubscriberFilter ImageSubscriberFilter;
-      ImageSubscriberFilter imagergb_sub;
-      ImageSubscriberFilter imagedepth_sub;
       typedef message_filters::sync_policies::ApproximateTime<sensor_msgs::Image, sensor_msgs::Image> MySyncPolicy_1;
-      message_filters::Synchronizer<MySyncPolicy_1> sync_1;
+      typedef message_filters::sync_policies::ApproximateTime<sensor_msgs::Image, sensor_msgs::Image, sensor_msgs::CameraInfo> MySyncPolicy_2;
+
+      // One RealSense unit: its subscriptions, newest frame, detection history and publishers.
+      typedef struct
+      {
+         std::string ns;
+         ImageSubscriberFilter imagergb_sub;
+         ImageSubscriberFilter imagedepth_sub;
+         message_filters::Subscriber<sensor_msgs::CameraInfo> camerainfo_sub;
+         std::shared_ptr<message_filters::Synchronizer<MySyncPolicy_1> > sync_1;   // Without camera_info.
+         std::shared_ptr<message_filters::Synchronizer<MySyncPolicy_2> > sync_2;
+         FrameMailbox<CameraFrame_> mailbox;
+         BackProjection backProjection;
+         PredictionAverager averager;
+         letterbox_scratch letterbox;   // Used by the fetch stage only.
+         ros::Publisher objectPublisher;
+         ros::Publisher boundingBoxesPublisher;
+         ros::Publisher detectionImagePublisher;
+         ros::Publisher objectPositionPublisher;
+      }
+      CameraStream_;
+
+      // Cameras batched into one forward pass.
+      std::vector<std::shared_ptr<CameraStream_> > cameras_;
+      FrameSignal frameSignal_;
+      double gatherTimeout_;
+
+      // Action goals and other offline images, batched on their own network so they never touch the camera slots.
+      typedef struct
+      {
+         CheckForObjectsGoalHandle goal;
+         cv_bridge::CvImageConstPtr image;
+         int id;
+         double queuedTime;
+      }
+      OfflineRequest_;
+      std::shared_ptr<DynamicBatcher<OfflineRequest_> > offlineQueue_;
+      network *offlineNet_;
+      std::mutex gpuMutex_;   // One forward pass at a time on the GPU, see predict().
+      int offlineBatch_;
+      double offlineBatchTimeout_;
+      double offlineDeadline_;   // Goals still queued after this many seconds are aborted, 0 never expires them.
+      std::thread offlineThread_;
+      DetectionBuffer offlineDetections_;
+      DetectionDecoder offlineDecoder_;
+      NmsEngine offlineNms_;
+      int offlineCpu_;
+
+      // Offline lane latency (wait is time queued, service is batch inference) and goals not answered with boxes.
+      StageStats offlineStats_;
+      std::atomic<unsigned long> offlineAborted_;
+      std::atomic<unsigned long> offlineCanceled_;
+      std::mutex offlineGoalMutex_;   // Serialises the terminal transitions of goals: cancel, abort and succeed.
+      double lastOfflineStatsTime_;
+
+      // Intrinsics of frames without CameraInfo, colour to depth frame offset in metres.
+      CameraIntrinsics_ defaultIntrinsics_;
+      float depthOffsetX_;
+      float depthOffsetY_;
+      const BackProjection *backProjection_;   // Camera of the frame being published.
 
       // Depth Image - For depth inclussion
-      cv::Mat DepthImageCopy_;
-      void Coordinates(int ObjID, int xmin, int ymin, int xmax, int ymax);
+      void Coordinates(const cv::Mat& rgbImage, const cv::Mat& depthImage, int ObjID, int xmin, int ymin, int xmax, int ymax);
       bool Invalid;
+      DepthStatistics depthStatistics_;
+      DepthStatistic depthStatistic_;
+      int colourGroup(int ObjID);
+      void colourMask(const cv::Mat& hsv, int group, cv::Mat& mask);
+
+      // Per depth frame summed-area tables, built lazily per colour.
+      void prepareDepthFrame(const cv::Mat& depthImage);
+      static const int numColourGroups_ = 5;
+      bool useDepthIntegral_;
+      int depthProbeRadius_;
+      DepthIntegral depthIntegral_;
+      DepthIntegral colourIntegrals_[numColourGroups_];
+      cv::Mat hsvFrame_;
       float X;
       float Y;
       float Z;
       
       // Detected objects.
-      std::vector<std::vector<RosBox_> > rosBoxes_;
-      std::vector<int> rosBoxCounter_;
+      int detectionTopK_;   // Detections kept per class and frame, 0 keeps all.
+      float nmsThreshold_;  // IoU above which boxes are suppressed, 0 disables NMS.
+      NmsEngine nms_;       // Used by the detect stage only.
+      DetectionDecoder decoder_;   // Detect stage arena, get_network_boxes is only used for REGION and DETECTION outputs.
       darknet_ros_msgs::BoundingBoxes boundingBoxesResults_;
       darknet_ros_msgs::Object objectPosition_;
 
-      // Camera related parameters.
-      int frameWidth_;
-      int frameHeight_;
+      // Shared-memory result channel read by the consumers on this machine.
+      bool resultChannelEnabled_;
+      std::string resultChannelName_;
+      ResultChannelWriter resultChannel_;
 
-      // Publisher of the bounding box image.
-      ros::Publisher detectionImagePublisher_;
-      
-      // Publisher of the object position
-      ros::Publisher objectPositionPublisher_;
+      // UDP result stream to the second computer.
+      UdpResultPublisher udpPublisher_;
 
       // Yolo running on thread.
       std::thread yoloThread_;
 
       // Darknet.
       char **demoNames_;
-      image **demoAlphabet_;
       int demoClasses_;
 
       network *net_;
-      image buff_[3];
-      image buffLetter_[3];
-      int buffId_[3];
-      int buffIndex_ = 0;
-      IplImage * ipl_;
+      std::string weightCachePath_;   // Empty: no cache.
+      WeightCache weightCache_;
       float fps_ = 0;
       float demoThresh_ = 0;
       float demoHier_ = .5;
@@ -197,66 +302,143 @@ namespace darknet_ros
 
       int demoDelay_ = 0;
       int demoFrame_ = 2;
-      float **predictions_;
-      int demoIndex_ = 0;
       int demoDone_ = 0;
-      float *lastAvg2_;
-      float *lastAvg_;
-      float *avg_;
       int demoTotal_ = 0;
+      AveragingMode averagingMode_;
+      float averagingDecay_;
       double demoTime_;
+
+      // Cold start, logged with the first detection: init() start, weight and offline network load, init() to first frame.
+      double startupTime_;
+      double startupWeights_;
+      double startupOffline_;
+      double startupFirstFrame_;
     
-      RosBox_ *roiBoxes_;
       bool viewImage_;
+      RenderMode renderMode_;
+      bool drawAxes_;               // Overlay only: the image axes the orientation is sampled along.
+      OverlayRenderer overlay_;     // Used by the publish stage only.
+      bool zeroCopy_;
       bool enableConsoleOutput_;
       int waitKeyDelay_;
       int fullScreen_;
       char *demoPrefix_;
 
-      std_msgs::Header imageHeader_;
-      cv::Mat camImageCopy_;
-      boost::shared_mutex mutexImageCallback_;
-
-      bool imageStatus_ = false;
-      boost::shared_mutex mutexImageStatus_;
-
       bool isNodeRunning_ = true;
       boost::shared_mutex mutexNodeStatus_;
 
-      int actionId_;
-      boost::shared_mutex mutexActionStatus_;
+      // Frame slots handed between the long-lived pipeline stages, one per stage.
+      static const int numSlots_ = 4;
+      FrameSlot_ slots_[numSlots_];
+      StageQueue<int> freeQueue_;
+      StageQueue<int> detectQueue_;
+      StageQueue<int> publishQueue_;
+      StageQueue<int> poseQueue_;
+      enum SlotStage {SLOT_FETCH, SLOT_DETECT, SLOT_PUBLISH, SLOT_POSE};
+      SlotOwnership slotOwners_;
+      std::atomic<unsigned long> slotClaimFailures_;
+      std::thread fetchThread_;
+      std::thread detectThread_;
+      std::thread poseThread_;
+
+      // Stage timing and CPU pinning (-1 leaves the stage unpinned).
+      StageStats fetchStats_;
+      StageStats detectStats_;
+      StageStats publishStats_;
+      StageStats poseStats_;
+      double statsPeriod_;
+      double lastStatsTime_;
+      int fetchCpu_;
+      int detectCpu_;
+      int publishCpu_;
+      int poseCpu_;
 
       // double getWallTime();
 
       int sizeNetwork(network *net);
 
-      void rememberNetwork(network *net);
+      void rememberNetwork(network *net, int camera);
+
+      // Decodes the (averaged) outputs of camera - @return detections to hand back through releasePredictions().
+      detection *avgPredictions(network *net, int camera, int width, int height, int *nboxes);
 
-      detection *avgPredictions(network *net, int *nboxes);
+      void releasePredictions(const DetectionDecoder& decoder, detection *dets, int nboxes);
 
-      void *detectInThread();
+      // get_network_boxes of batch entry 0 alone, never blended with entry 1 as a flipped image.
+      detection *networkBoxes(network *net, int width, int height, int *nboxes);
 
-      void *fetchInThread();
+      void *detectInThread(int slot);
 
-      void *displayInThread(void *ptr);
+      void decodeCamera(int slot, int camera);
 
-      void *displayLoop(void *ptr);
+      // Collects the boxes of the detections into the class buckets of the buffer.
+      void extractBoxes(detection *dets, int nboxes, DetectionBuffer& detections);
 
-      void *detectLoop(void *ptr);
+      // Boxes the output layers can produce per image, the capacity of the detection buffers.
+      size_t detectionCapacity(network *net);
+
+      // @return true if the goal is in a terminal state and must not be completed again.
+      static bool goalFinished(CheckForObjectsGoalHandle& goal);
+
+      // load_network, or the weights mapped from the weight cache (built on first use) when one is configured.
+      network *loadNetwork(char *cfgfile, char *weightfile);
+
+      // network_predict, serialised with the other lane in GPU builds - @return the output of the last layer.
+      float *predict(network *net, float *input);
+
+      // Points the parameters of dst at those of src, both built from the same cfg - @return false, with dst untouched, if a layer type is not supported.
+      bool shareNetworkWeights(network *dst, network *src);
+
+      void offlineLoop();
+
+      void detectOffline(const std::vector<OfflineRequest_>& requests, image input, letterbox_scratch& letterbox);
+
+      void *fetchInThread(int slot, int camera, const CameraFrame_& frame);
+
+      void *displayInThread(int slot, int camera);
+
+      // Draws the boxes of a camera on a copy of its BGR8 frame, into view.render.
+      void renderDetections(CameraView_& view);
+
+      // Colour darknet's draw_detections gives a class, BGR.
+      cv::Scalar classColour(int classId) const;
+
+      void *fetchLoop();
+
+      void *detectLoop();
+
+      void publishLoop();
+
+      void *poseLoop();
+
+      void reportPipelineStats();
+
+      // Hands the slot to the popping stage, reports a slot that did not come from the stage before it.
+      void claimSlot(int slot, SlotStage to);
+
+      // Stage a slot is claimed from, the one before stage in the ring.
+      static SlotStage previousStage(SlotStage stage);
+
+      // @return true if a slot goes around the ring from its initial owner without a failed claim.
+      static bool checkSlotRing();
+
+      void reportOfflineStats();
+
+      void pinThread(pthread_t thread, int cpu, const char *name);
 
       void setupNetwork(char *cfgfile, char *weightfile, char *datafile, float thresh, char **names, int classes, int delay, char *prefix, int avg_frames, float hier, int w, int h, int frames, int fullscreen);
 
-     cv::Vec3f getDepth(const cv::Mat & depthImage, int x, int y, float cx, float cy, float fx, float fy);
+     cv::Vec3f getDepth(const cv::Mat & depthImage, int x, int y);
      float getDepth2(const cv::Mat & depthImage, int xmin, int ymin, int xmax, int ymax);
 
       void yolo();
 
-      IplImage* getIplImage();
-
-      bool getImageStatus(void);
+      // Fills the slot with the new frames of the cameras - @param[out] service time spent converting them - @return false on shutdown.
+      bool waitForFrames(int slot, double& service);
     
       bool isNodeRunning(void);
 
-      void *publishInThread();
+      // Boxes, depth and 3D poses of a camera's frame - runs on the pose stage, off the display and detection path.
+      void *poseInThread(int slot, int camera);
    };
 }
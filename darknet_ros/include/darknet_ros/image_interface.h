@@ -13,4 +13,22 @@
 
 image **load_alphabet_with_file(char *datafile);
 
+// Horizontal taps and the blended source row of bgr8_letterbox_into, owned by the caller and
+// reallocated only when the source width or the embedded width change.
+typedef struct {
+    int *x0;
+    float *fx;
+    float *row;
+    int w;
+    int new_w;
+} letterbox_scratch;
+
+letterbox_scratch make_letterbox_scratch(void);
+void free_letterbox_scratch(letterbox_scratch *s);
+
+// Fused ipl_into_image + rgbgr_image + letterbox_image_into: resizes an interleaved BGR8 buffer
+// into the letterboxed planar RGB float network input in a single pass. Returns 0, leaving the
+// whole input as padding, if the scratch cannot be allocated.
+int bgr8_letterbox_into(const unsigned char *src, int w, int h, int step, image boxed, letterbox_scratch *scratch);
+
 #endif
@@ -27,8 +27,6 @@
 #include <string.h>
 #include <dirent.h>
 
-#include <sys/ipc.h>
-#include <sys/shm.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/select.h>
@@ -58,86 +56,8 @@ std::string darknetFilePath_ = DARKNET_FILE_PATH;
 #endif
 
 
-#define xData 	8001
-#define yData 	8002
-#define zData 	8003
-#define qXData 	8004
-#define qYData 	8005
-#define qZData 	8006
-#define qQData 	8007
-#define xData1 	8008
-#define yData1 	8009
-#define zData1 	8010
-
-struct daKom{
-	char header[7];
-	float X;
-	float Y;
-	float Z;
-	float QX;
-	float QY;
-	float QZ;
-	float QQ;
-
-	float X1;
-	float Y1;
-	float Z1;
-};
-
-static int *resultX, *resultY, *resultZ,*resultX1, *resultY1, *resultZ1, *resultQX, *resultQY, *resultQZ, *resultQQ;
 ros::Subscriber sub;
 
-void indivData(){
-	int KeyX = xData;	int KeyY = yData;
-	int KeyZ = zData;	int KeyQQ = qQData;
-	int KeyQX = qXData; int KeyQY = qYData; int KeyQZ = qZData;
-
-	int KeyX1 = xData1;	int KeyY1 = yData1;
-	int KeyZ1 = zData1;
-
-	int spaceIdX = shmget(KeyX, sizeof(int), IPC_CREAT | S_IRUSR | S_IWUSR);
-	resultX = (int*)shmat(spaceIdX, NULL, 0);
-
-	int spaceIdY = shmget(KeyY, sizeof(int), IPC_CREAT | S_IRUSR | S_IWUSR);
-	resultY = (int*)shmat(spaceIdY, NULL, 0);
-
-	int spaceIdZ = shmget(KeyZ, sizeof(int), IPC_CREAT | S_IRUSR | S_IWUSR);
-	resultZ = (int*)shmat(spaceIdZ, NULL, 0);
-
-	int spaceIdQX = shmget(KeyQX, sizeof(int), IPC_CREAT | S_IRUSR | S_IWUSR);
-	resultQX = (int*)shmat(spaceIdQX, NULL, 0);
-
-	int spaceIdQY = shmget(KeyQY, sizeof(int), IPC_CREAT | S_IRUSR | S_IWUSR);
-	resultQY = (int*)shmat(spaceIdQY, NULL, 0);
-
-	int spaceIdQZ = shmget(KeyQZ, sizeof(int), IPC_CREAT | S_IRUSR | S_IWUSR);
-	resultQZ = (int*)shmat(spaceIdQZ, NULL, 0);
-
-	int spaceIdQQ = shmget(KeyQQ, sizeof(int), IPC_CREAT | S_IRUSR | S_IWUSR);
-	resultQQ = (int*)shmat(spaceIdQQ, NULL, 0);
-
-	int spaceIdX1 = shmget(KeyX1, sizeof(int), IPC_CREAT | S_IRUSR | S_IWUSR);
-	resultX1 = (int*)shmat(spaceIdX1, NULL, 0);
-
-	int spaceIdY1 = shmget(KeyY1, sizeof(int), IPC_CREAT | S_IRUSR | S_IWUSR);
-	resultY1 = (int*)shmat(spaceIdY1, NULL, 0);
-
-	int spaceIdZ1 = shmget(KeyZ1, sizeof(int), IPC_CREAT | S_IRUSR | S_IWUSR);
-	resultZ1 = (int*)shmat(spaceIdZ1, NULL, 0);
-
-//	*resultO = datO;
-	*resultX = 0;
-	*resultY = 0;
-	*resultZ = 0;
-	*resultQX = 0;
-	*resultQY = 0;
-	*resultQZ = 0;
-	*resultQQ = 0;
-
-	*resultX1 = 0;
-	*resultY1 = 0;
-	*resultZ1 = 0;
-}
 float theta=0, cv_x=0, cv_y=0;
 void callBack(const detect_plate::Tracker::ConstPtr& msg)
 {
@@ -158,11 +78,15 @@ namespace darknet_ros
          imageTransport_(nodeHandle_),
          numClasses_(0),
          classLabels_(0),
-         rosBoxes_(0),
-         rosBoxCounter_(0),
-         imagergb_sub(imageTransport_,"/camera/color/image_raw",1),       //For depth inclussion
-         imagedepth_sub(imageTransport_,"/camera/depth/image_rect_raw",1),   //For depth inclussion
-         sync_1(MySyncPolicy_1(5), imagergb_sub, imagedepth_sub)        //For depth inclussion
+         freeQueue_(numSlots_),
+         detectQueue_(numSlots_),
+         publishQueue_(numSlots_),
+         poseQueue_(numSlots_),
+         slotOwners_(numSlots_, SLOT_POSE),
+         slotClaimFailures_(0),
+         offlineNet_(0),
+         offlineAborted_(0),
+         offlineCanceled_(0)
 
    {
       ROS_INFO("[YoloObjectDetector] Node started.");
@@ -182,6 +106,34 @@ namespace darknet_ros
          isNodeRunning_ = false;
       }
    yoloThread_.join();
+      if (offlineQueue_)
+      {
+         offlineQueue_->close();
+      }
+      if (offlineThread_.joinable())
+      {
+         offlineThread_.join();
+      }
+      for (size_t k = 0; k < cameras_.size(); ++k)
+      {
+         free_letterbox_scratch(&cameras_[k]->letterbox);
+      }
+
+      // Goals still queued at shutdown are answered instead of leaving their clients waiting.
+      if (offlineQueue_)
+      {
+         offlineQueue_->removeIf([this](OfflineRequest_& request)
+         {
+            darknet_ros_msgs::CheckForObjectsResult objectsActionResult;
+            objectsActionResult.id = request.id;
+            std::lock_guard<std::mutex> lock(offlineGoalMutex_);
+            if (!goalFinished(request.goal))
+            {
+               request.goal.setAborted(objectsActionResult, "Detector shutting down.");
+            }
+            return true;
+         });
+      }
    }
 
    bool YoloObjectDetector::readParameters()
@@ -190,6 +142,70 @@ namespace darknet_ros
       nodeHandle_.param("image_view/enable_opencv", viewImage_, true);
       nodeHandle_.param("image_view/wait_key_delay", waitKeyDelay_, 3);
       nodeHandle_.param("image_view/enable_console_output", enableConsoleOutput_, false);
+      std::string renderer;
+      nodeHandle_.param("image_view/renderer", renderer, std::string("overlay"));
+      nodeHandle_.param("image_view/draw_axes", drawAxes_, false);
+      if (renderer == "opencv")
+         renderMode_ = RENDER_OPENCV;
+      else
+      {
+         if (renderer != "overlay")
+            ROS_WARN("[YoloObjectDetector] Unknown image_view/renderer '%s', using overlay.", renderer.c_str());
+         renderMode_ = RENDER_OVERLAY;
+      }
+
+      // Pipeline statistics and stage pinning.
+      nodeHandle_.param("pipeline/stats_period", statsPeriod_, 5.0);
+      nodeHandle_.param("pipeline/fetch_cpu", fetchCpu_, -1);
+      nodeHandle_.param("pipeline/detect_cpu", detectCpu_, -1);
+      nodeHandle_.param("pipeline/publish_cpu", publishCpu_, -1);
+      nodeHandle_.param("pipeline/pose_cpu", poseCpu_, -1);
+
+      // Temporal smoothing of the detection layer outputs, per camera.
+      std::string averagingMode;
+      nodeHandle_.param("yolo_model/averaging/mode", averagingMode, std::string("window"));
+      nodeHandle_.param("yolo_model/averaging/frames", demoFrame_, 1);
+      nodeHandle_.param("yolo_model/averaging/decay", averagingDecay_, 0.5f);
+      if (averagingMode == "exponential")
+         averagingMode_ = AVERAGE_EXPONENTIAL;
+      else
+      {
+         if (averagingMode != "window")
+            ROS_WARN("[YoloObjectDetector] Unknown yolo_model/averaging/mode '%s', using window.", averagingMode.c_str());
+         averagingMode_ = AVERAGE_WINDOW;
+      }
+      if (demoFrame_ < 1)
+      {
+         ROS_WARN("[YoloObjectDetector] yolo_model/averaging/frames must be positive, using 1.");
+         demoFrame_ = 1;
+      }
+
+      // Depth of a box.
+      std::string depthStatistic;
+      float depthPercentile, depthTrim;
+      nodeHandle_.param("depth/statistic", depthStatistic, std::string("mean"));
+      nodeHandle_.param("depth/percentile", depthPercentile, 0.1f);
+      nodeHandle_.param("depth/trim_fraction", depthTrim, 0.1f);
+      nodeHandle_.param("depth/use_integral_image", useDepthIntegral_, false);
+      nodeHandle_.param("depth/probe_radius", depthProbeRadius_, 0);
+      depthStatistics_.setPercentile(depthPercentile);
+      depthStatistics_.setTrim(depthTrim);
+      if (depthStatistic == "median")
+         depthStatistic_ = DEPTH_MEDIAN;
+      else if (depthStatistic == "trimmed_mean")
+         depthStatistic_ = DEPTH_TRIMMED_MEAN;
+      else if (depthStatistic == "percentile")
+         depthStatistic_ = DEPTH_PERCENTILE;
+      else
+      {
+         if (depthStatistic != "mean")
+            ROS_WARN("[YoloObjectDetector] Unknown depth/statistic '%s', using mean.", depthStatistic.c_str());
+         depthStatistic_ = DEPTH_MEAN;
+      }
+      if (useDepthIntegral_ && depthStatistic_ != DEPTH_MEAN)
+      {
+         ROS_WARN("[YoloObjectDetector] depth/use_integral_image only serves the mean, boxes are scanned for %s.", depthStatistic.c_str());
+      }
 
       // Check if Xserver is running on Linux.
       if (XOpenDisplay(NULL))
@@ -203,11 +219,63 @@ namespace darknet_ros
          viewImage_ = false;
       }
 
+      // Camera streams batched into one forward pass; the network batch is sized from them.
+      std::vector<std::string> cameraNamespaces;
+      nodeHandle_.param("subscribers/camera_streams/namespaces", cameraNamespaces, std::vector<std::string>(1, "/camera"));
+      nodeHandle_.param("subscribers/camera_streams/gather_timeout", gatherTimeout_, 0.015);
+      if (cameraNamespaces.empty())
+      {
+         cameraNamespaces.push_back("/camera");
+      }
+      for (size_t i = 0; i < cameraNamespaces.size(); ++i)
+      {
+         std::shared_ptr<CameraStream_> camera(new CameraStream_());
+         camera->ns = cameraNamespaces[i];
+         camera->letterbox = make_letterbox_scratch();
+         cameras_.push_back(camera);
+      }
+
+      // Offline lane of the check for objects action: up to batch_size goals per forward pass, none waits longer than batch_timeout.
+      int offlineQueueSize;
+      nodeHandle_.param("actions/camera_reading/batch_size", offlineBatch_, 4);
+      nodeHandle_.param("actions/camera_reading/batch_timeout", offlineBatchTimeout_, 0.01);
+      nodeHandle_.param("actions/camera_reading/queue_size", offlineQueueSize, 64);
+      nodeHandle_.param("actions/camera_reading/deadline", offlineDeadline_, 0.5);
+      nodeHandle_.param("pipeline/offline_cpu", offlineCpu_, -1);
+      if (offlineBatch_ < 1)
+      {
+         ROS_WARN("[YoloObjectDetector] actions/camera_reading/batch_size must be positive, using 1.");
+         offlineBatch_ = 1;
+      }
+      offlineQueue_.reset(new DynamicBatcher<OfflineRequest_>(std::max(offlineQueueSize, 1)));
+
       // Set vector sizes.
       nodeHandle_.param("yolo_model/detection_classes/names", classLabels_, std::vector<std::string>(0));
       numClasses_ = classLabels_.size();
-      rosBoxes_ = std::vector<std::vector<RosBox_> >(numClasses_);
-      rosBoxCounter_ = std::vector<int>(numClasses_);
+      nodeHandle_.param("yolo_model/detection_classes/top_k", detectionTopK_, 0);
+      nodeHandle_.param("yolo_model/weight_cache/path", weightCachePath_, std::string(""));
+
+      // Non-maximum suppression, one engine per detecting thread.
+      std::string nmsModeName;
+      bool nmsSoft;
+      float nmsSoftSigma;
+      nodeHandle_.param("yolo_model/nms/mode", nmsModeName, std::string("class"));
+      nodeHandle_.param("yolo_model/nms/iou_threshold", nmsThreshold_, 0.4f);
+      nodeHandle_.param("yolo_model/nms/soft", nmsSoft, false);
+      nodeHandle_.param("yolo_model/nms/soft_sigma", nmsSoftSigma, 0.5f);
+      NmsMode nmsMode;
+      if (nmsModeName == "darknet")
+         nmsMode = NMS_DARKNET;
+      else if (nmsModeName == "agnostic")
+         nmsMode = NMS_AGNOSTIC;
+      else
+      {
+         if (nmsModeName != "class")
+            ROS_WARN("[YoloObjectDetector] Unknown yolo_model/nms/mode '%s', using class.", nmsModeName.c_str());
+         nmsMode = NMS_CLASS;
+      }
+      nms_.configure(nmsMode, nmsThreshold_, nmsSoft, nmsSoftSigma);
+      offlineNms_.configure(nmsMode, nmsThreshold_, nmsSoft, nmsSoftSigma);
 
       return true;
    }
@@ -215,6 +283,7 @@ namespace darknet_ros
    void YoloObjectDetector::init()
    {
       ROS_INFO("[YoloObjectDetector] init().");
+      startupTime_ = what_time_is_it_now();
 
       // Initialize deep network of darknet.
       std::string weightsPath;
@@ -256,8 +325,9 @@ namespace darknet_ros
       }
 
       // Load network.
-      setupNetwork(cfg, weights, data, thresh, detectionNames, numClasses_, 0, 0, 1, 0.5, 0, 0, 0, 0);
+      setupNetwork(cfg, weights, data, thresh, detectionNames, numClasses_, 0, 0, demoFrame_, 0.5, 0, 0, 0, 0);
       yoloThread_ = std::thread(&YoloObjectDetector::yolo, this);
+      offlineThread_ = std::thread(&YoloObjectDetector::offlineLoop, this);
 
       // Initialize publisher and subscriber.
       std::string cameraTopicName;
@@ -283,6 +353,7 @@ namespace darknet_ros
 
       nodeHandle_.param("subscribers/camera_depth/topic", depthTopicName, std::string("/depth/image_raw"));   //For depth inclussion
       nodeHandle_.param("subscribers/camera_depth/queue_size", depthQueueSize, 1);                            //For depth inclussion
+      nodeHandle_.param("subscribers/zero_copy", zeroCopy_, true);
 
       nodeHandle_.param("publishers/object_detector/topic", objectDetectorTopicName, std::string("found_object"));
       nodeHandle_.param("publishers/object_detector/queue_size", objectDetectorQueueSize, 1);
@@ -296,31 +367,110 @@ namespace darknet_ros
       nodeHandle_.param("publishers/detection_image/queue_size", detectionImageQueueSize, 1);
       nodeHandle_.param("publishers/detection_image/latch", detectionImageLatch, true);
 
-      sync_1.registerCallback(boost::bind(&YoloObjectDetector::cameraCallback,this,_1,_2));   //For depth inclussion
+      // Used when no camera_info arrives, e.g. for action goal images.
+      nodeHandle_.param("camera_intrinsics/fx", defaultIntrinsics_.fx, 614.0160522460938);
+      nodeHandle_.param("camera_intrinsics/fy", defaultIntrinsics_.fy, 614.0221557617188);
+      nodeHandle_.param("camera_intrinsics/cx", defaultIntrinsics_.cx, 327.8558654785156);
+      nodeHandle_.param("camera_intrinsics/cy", defaultIntrinsics_.cy, 247.04779052734375);
+      // Translation of rosrun tf tf_echo /camera_color_frame /camera_depth_frame.
+      nodeHandle_.param("camera_intrinsics/depth_offset_x", depthOffsetX_, -0.001f);
+      nodeHandle_.param("camera_intrinsics/depth_offset_y", depthOffsetY_, 0.015f);
 
       nodeHandle_.param("publishers/object_position/topic", objectPositionTopicName, std::string("object_position"));
       nodeHandle_.param("publishers/object_position/queue_size", objectPositionQueueSize, 1);
       nodeHandle_.param("publishers/object_position/latch", objectPositionLatch, false);
 
-      objectPublisher_ = nodeHandle_.advertise<std_msgs::Int8>(objectDetectorTopicName, objectDetectorQueueSize, objectDetectorLatch);
-      boundingBoxesPublisher_ = nodeHandle_.advertise<darknet_ros_msgs::BoundingBoxes>(boundingBoxesTopicName, boundingBoxesQueueSize, boundingBoxesLatch);
-      detectionImagePublisher_ = nodeHandle_.advertise<sensor_msgs::Image>(detectionImageTopicName, detectionImageQueueSize, detectionImageLatch);
-      objectPositionPublisher_ = nodeHandle_.advertise<darknet_ros_msgs::Object>(objectPositionTopicName, objectPositionQueueSize, objectPositionLatch);
+      // Colour, depth and (unless disabled) colour camera_info of every camera, synchronized like CameraROS.
+      bool cameraInfoEnabled;
+      std::string streamColorTopic;
+      std::string streamDepthTopic;
+      std::string streamInfoTopic;
+      nodeHandle_.param("subscribers/camera_info/enable", cameraInfoEnabled, true);
+      nodeHandle_.param("subscribers/camera_streams/color_topic", streamColorTopic, std::string("color/image_raw"));
+      nodeHandle_.param("subscribers/camera_streams/depth_topic", streamDepthTopic, std::string("depth/image_rect_raw"));
+      nodeHandle_.param("subscribers/camera_streams/info_topic", streamInfoTopic, std::string("color/camera_info"));
+      // Launch files of the single camera node set the full topics, they are honoured while no camera namespaces are configured.
+      bool legacyTopics = !nodeHandle_.hasParam("subscribers/camera_streams/namespaces")
+                          && (nodeHandle_.hasParam("subscribers/camera_reading/topic") || nodeHandle_.hasParam("subscribers/camera_depth/topic"));
+      for (size_t i = 0; i < cameras_.size(); ++i)
+      {
+         CameraStream_& camera = *cameras_[i];
+         std::string colorTopic = camera.ns + "/" + streamColorTopic;
+         std::string depthTopic = camera.ns + "/" + streamDepthTopic;
+         std::string infoTopic = camera.ns + "/" + streamInfoTopic;
+         if (legacyTopics)
+         {
+            colorTopic = cameraTopicName;
+            depthTopic = depthTopicName;
+            infoTopic = image_transport::getCameraInfoTopic(cameraTopicName);
+         }
+         camera.imagergb_sub.subscribe(imageTransport_, colorTopic, cameraQueueSize);   //For depth inclussion
+         camera.imagedepth_sub.subscribe(imageTransport_, depthTopic, depthQueueSize);
+         if (cameraInfoEnabled)
+         {
+            camera.camerainfo_sub.subscribe(nodeHandle_, infoTopic, cameraQueueSize);
+            camera.sync_2.reset(new message_filters::Synchronizer<MySyncPolicy_2>(MySyncPolicy_2(5), camera.imagergb_sub, camera.imagedepth_sub, camera.camerainfo_sub));
+            camera.sync_2->registerCallback(boost::bind(&YoloObjectDetector::cameraCallback,this,_1,_2,_3,(int) i));
+         }
+         else
+         {
+            camera.sync_1.reset(new message_filters::Synchronizer<MySyncPolicy_1>(MySyncPolicy_1(5), camera.imagergb_sub, camera.imagedepth_sub));   //For depth inclussion
+            camera.sync_1->registerCallback(boost::bind(&YoloObjectDetector::cameraCallback,this,_1,_2,sensor_msgs::CameraInfoConstPtr(),(int) i));
+         }
+
+         // The first camera keeps the plain topic names, camera i publishes on <topic>_<i>.
+         std::string suffix = i == 0 ? std::string() : "_" + std::to_string(i);
+         camera.objectPublisher = nodeHandle_.advertise<std_msgs::Int8>(objectDetectorTopicName + suffix, objectDetectorQueueSize, objectDetectorLatch);
+         camera.boundingBoxesPublisher = nodeHandle_.advertise<darknet_ros_msgs::BoundingBoxes>(boundingBoxesTopicName + suffix, boundingBoxesQueueSize, boundingBoxesLatch);
+         camera.detectionImagePublisher = nodeHandle_.advertise<sensor_msgs::Image>(detectionImageTopicName + suffix, detectionImageQueueSize, detectionImageLatch);
+         camera.objectPositionPublisher = nodeHandle_.advertise<darknet_ros_msgs::Object>(objectPositionTopicName + suffix, objectPositionQueueSize, objectPositionLatch);
+      }
 
       // Action servers.
       std::string checkForObjectsActionName;
       nodeHandle_.param("actions/camera_reading/topic", checkForObjectsActionName, std::string("check_for_objects"));
       checkForObjectsActionServer_.reset(new CheckForObjectsActionServer(nodeHandle_, checkForObjectsActionName, false));
-      checkForObjectsActionServer_->registerGoalCallback(boost::bind(&YoloObjectDetector::checkForObjectsActionGoalCB, this));
-      checkForObjectsActionServer_->registerPreemptCallback(boost::bind(&YoloObjectDetector::checkForObjectsActionPreemptCB, this));
+      checkForObjectsActionServer_->registerGoalCallback(boost::bind(&YoloObjectDetector::checkForObjectsActionGoalCB, this, _1));
+      checkForObjectsActionServer_->registerCancelCallback(boost::bind(&YoloObjectDetector::checkForObjectsActionCancelCB, this, _1));
       checkForObjectsActionServer_->start();
+
+      // Shared-memory result channel.
+      nodeHandle_.param("result_channel/enable", resultChannelEnabled_, true);
+      nodeHandle_.param("result_channel/name", resultChannelName_, std::string("/darknet_ros_results"));
+      if (resultChannelEnabled_ && !resultChannel_.open(resultChannelName_))
+      {
+         ROS_ERROR("[YoloObjectDetector] Could not open result channel %s: %s", resultChannelName_.c_str(), strerror(errno));
+      }
+
+      // UDP result stream, unicast or multicast depending on the address.
+      bool udpEnabled;
+      std::string udpAddress;
+      int udpPort;
+      int udpMulticastTtl;
+      int udpMaxDatagram;
+      nodeHandle_.param("udp_publisher/enable", udpEnabled, false);
+      nodeHandle_.param("udp_publisher/address", udpAddress, std::string("127.0.0.1"));
+      nodeHandle_.param("udp_publisher/port", udpPort, 5005);
+      nodeHandle_.param("udp_publisher/multicast_ttl", udpMulticastTtl, 1);
+      nodeHandle_.param("udp_publisher/max_datagram", udpMaxDatagram, 1400);
+      if (udpMaxDatagram < (int) kUdpMinDatagram || udpMaxDatagram > (int) kUdpMaxDatagram)
+      {
+         int clamped = std::min(std::max(udpMaxDatagram, (int) kUdpMinDatagram), (int) kUdpMaxDatagram);
+         ROS_WARN("[YoloObjectDetector] udp_publisher/max_datagram %d out of [%zu, %zu], using %d.", udpMaxDatagram, kUdpMinDatagram, kUdpMaxDatagram, clamped);
+         udpMaxDatagram = clamped;
+      }
+      if (udpEnabled && !udpPublisher_.open(udpAddress, udpPort, udpMulticastTtl, udpMaxDatagram))
+      {
+         ROS_ERROR("[YoloObjectDetector] Could not open UDP publisher to %s:%d.", udpAddress.c_str(), udpPort);
+      }
    }
 
-   void YoloObjectDetector::cameraCallback(const sensor_msgs::ImageConstPtr& msg, const sensor_msgs::ImageConstPtr& msgdepth)
+   void YoloObjectDetector::cameraCallback(const sensor_msgs::ImageConstPtr& msg, const sensor_msgs::ImageConstPtr& msgdepth, const sensor_msgs::CameraInfoConstPtr& info, int camera)
    {
 
       ROS_DEBUG("[YoloObjectDetector] USB image received.");
-      cv_bridge::CvImagePtr cam_image;
+      uint64_t receivedNs = udpResultClockNs();
+      cv_bridge::CvImageConstPtr cam_image;
       cv_bridge::CvImageConstPtr cam_depth;
 
       //if (msgdepth->encoding == sensor_msgs::image_encodings::TYPE_32FC1)
@@ -330,11 +480,18 @@ namespace darknet_ros
 
       try
       {
-         cam_image = cv_bridge::toCvCopy(msg, sensor_msgs::image_encodings::BGR8);
-         cam_depth = cv_bridge::toCvCopy(msgdepth, sensor_msgs::image_encodings::TYPE_32FC1);
+         // Shared images point into the message buffers, which the frame keeps alive.
+         if (zeroCopy_)
+         {
+            cam_image = cv_bridge::toCvShare(msg, sensor_msgs::image_encodings::BGR8);
+            cam_depth = cv_bridge::toCvShare(msgdepth, sensor_msgs::image_encodings::TYPE_32FC1);
+         }
+         else
+         {
+            cam_image = cv_bridge::toCvCopy(msg, sensor_msgs::image_encodings::BGR8);
+            cam_depth = cv_bridge::toCvCopy(msgdepth, sensor_msgs::image_encodings::TYPE_32FC1);
+         }
 		 //cam_depth = cv_bridge::toCvCopy(msgdepth, sensor_msgs::image_encodings::MONO8);
-
-         imageHeader_ = msg->header;
       }
 
       catch (cv_bridge::Exception& e)
@@ -346,81 +503,109 @@ namespace darknet_ros
 
       if (cam_image)
       {
+         CameraFrame_ frame;
+         frame.rgb = cam_image;
+         frame.depth = cam_depth;
+         frame.header = msg->header;
+         frame.camera = camera;
+         frame.receivedNs = receivedNs;
+         frame.intrinsics = defaultIntrinsics_;
+         frame.intrinsics.width = cam_image->image.cols;
+         frame.intrinsics.height = cam_image->image.rows;
+         if (info && !intrinsicsFromCameraInfo(*info, cam_image->image.cols, cam_image->image.rows, frame.intrinsics))
          {
-            boost::unique_lock<boost::shared_mutex> lockImageCallback(mutexImageCallback_);
-            camImageCopy_ = cam_image->image.clone();
+            ROS_WARN_THROTTLE(5, "[YoloObjectDetector] camera_info without intrinsics, using camera_intrinsics/*.");
          }
+         if (!cameras_[camera]->mailbox.post(frame, msg->header.stamp.toNSec()))
          {
-            boost::unique_lock<boost::shared_mutex> lockImageStatus(mutexImageStatus_);
-            imageStatus_ = true;
+            ROS_DEBUG("[YoloObjectDetector] Duplicate image ignored.");
          }
-         frameWidth_ = cam_image->image.size().width;
-         frameHeight_ = cam_image->image.size().height;
-      }
-
-      if (cam_depth)
-      {
-         DepthImageCopy_ = cam_depth->image.clone();
-	//cv::imshow("DepthImageCopy_",DepthImageCopy_);
+         frameSignal_.notify();
       }
 
       return;
    }
 
-   void YoloObjectDetector::checkForObjectsActionGoalCB()
+   void YoloObjectDetector::checkForObjectsActionGoalCB(CheckForObjectsGoalHandle goal)
    {
       ROS_DEBUG("[YoloObjectDetector] Start check for objects action.");
 
-      boost::shared_ptr<const darknet_ros_msgs::CheckForObjectsGoal> imageActionPtr = checkForObjectsActionServer_->acceptNewGoal();
-      sensor_msgs::Image imageAction = imageActionPtr->image;
+      boost::shared_ptr<const darknet_ros_msgs::CheckForObjectsGoal> imageActionPtr = goal.getGoal();
+      const sensor_msgs::Image& imageAction = imageActionPtr->image;
+      darknet_ros_msgs::CheckForObjectsResult objectsActionResult;
+      objectsActionResult.id = imageActionPtr->id;
 
-      cv_bridge::CvImagePtr cam_image;
+      OfflineRequest_ request;
+      request.goal = goal;
+      request.id = imageActionPtr->id;
+      request.queuedTime = what_time_is_it_now();
 
       try
       {
-         cam_image = cv_bridge::toCvCopy(imageAction, sensor_msgs::image_encodings::BGR8);
+         // The goal owns the image, keep it alive instead of copying the pixels.
+         request.image = cv_bridge::toCvShare(imageAction, imageActionPtr, sensor_msgs::image_encodings::BGR8);
       }
       
       catch (cv_bridge::Exception& e)
       {
          ROS_ERROR("cv_bridge exception: %s", e.what());
+         goal.setRejected(objectsActionResult, e.what());
          return;
       }
 
-      if (cam_image)
+      // The goal is answered from the offline lane with its own id, camera frames are not touched.
+      goal.setAccepted();
+      if (!offlineQueue_->push(request))
       {
+         ROS_WARN_THROTTLE(1, "[YoloObjectDetector] Check for objects queue is full, goal %d aborted.", request.id);
+         std::lock_guard<std::mutex> lock(offlineGoalMutex_);
+         if (!goalFinished(goal))
          {
-            boost::unique_lock<boost::shared_mutex> lockImageCallback(mutexImageCallback_);
-            camImageCopy_ = cam_image->image.clone();
-         }
-         {
-            boost::unique_lock<boost::shared_mutex> lockImageCallback(mutexActionStatus_);
-            actionId_ = imageActionPtr->id;
+            ++offlineAborted_;
+            goal.setAborted(objectsActionResult, "Request queue is full.");
          }
-         {
-            boost::unique_lock<boost::shared_mutex> lockImageStatus(mutexImageStatus_);
-            imageStatus_ = true;
-         }
-         frameWidth_ = cam_image->image.size().width;
-         frameHeight_ = cam_image->image.size().height;
       }
       return;
    }
 
-   void YoloObjectDetector::checkForObjectsActionPreemptCB()
+   void YoloObjectDetector::checkForObjectsActionCancelCB(CheckForObjectsGoalHandle goal)
    {
-      ROS_DEBUG("[YoloObjectDetector] Preempt check for objects action.");
-      checkForObjectsActionServer_->setPreempted();
+      ROS_DEBUG("[YoloObjectDetector] Cancel check for objects action.");
+      // A queued goal leaves the queue, one already in a running batch is not answered once it completes.
+      offlineQueue_->removeIf([&goal](const OfflineRequest_& request) { return request.goal == goal; });
+
+      // The offline lane completes goals under the same lock, a goal it already answered is left alone.
+      std::lock_guard<std::mutex> lock(offlineGoalMutex_);
+      if (goalFinished(goal))
+      {
+         return;
+      }
+      darknet_ros_msgs::CheckForObjectsResult objectsActionResult;
+      objectsActionResult.id = goal.getGoal()->id;
+      goal.setCanceled(objectsActionResult, "Canceled.");
+      ++offlineCanceled_;
    }
 
-   bool YoloObjectDetector::isCheckingForObjects() const
+   bool YoloObjectDetector::goalFinished(CheckForObjectsGoalHandle& goal)
    {
-      return (ros::ok() && checkForObjectsActionServer_->isActive() && !checkForObjectsActionServer_->isPreemptRequested());
+      // Terminal states, PENDING, ACTIVE, RECALLING and PREEMPTING can still be completed.
+      switch (goal.getGoalStatus().status)
+      {
+         case actionlib_msgs::GoalStatus::PREEMPTED:
+         case actionlib_msgs::GoalStatus::SUCCEEDED:
+         case actionlib_msgs::GoalStatus::ABORTED:
+         case actionlib_msgs::GoalStatus::REJECTED:
+         case actionlib_msgs::GoalStatus::RECALLED:
+         case actionlib_msgs::GoalStatus::LOST:
+            return true;
+         default:
+            return false;
+      }
    }
 
-   bool YoloObjectDetector::publishDetectionImage(const cv::Mat& detectionImage)
+   bool YoloObjectDetector::publishDetectionImage(const cv::Mat& detectionImage, ros::Publisher& publisher)
    {
-      if (detectionImagePublisher_.getNumSubscribers() < 1)
+      if (publisher.getNumSubscribers() < 1)
          return false;
 
       cv_bridge::CvImage cvImage;
@@ -428,7 +613,7 @@ namespace darknet_ros
       cvImage.header.frame_id = "detection_image";
       cvImage.encoding = sensor_msgs::image_encodings::BGR8;
       cvImage.image = detectionImage;
-      detectionImagePublisher_.publish(*cvImage.toImageMsg());
+      publisher.publish(*cvImage.toImageMsg());
 
       ROS_DEBUG("Detection image has been published.");
       return true;
@@ -459,60 +644,118 @@ namespace darknet_ros
       return count;
    }
 
-   void YoloObjectDetector::rememberNetwork(network *net)
+   void YoloObjectDetector::rememberNetwork(network *net, int camera)
    {
       int i;
       int count = 0;
+      CameraStream_& stream = *cameras_[camera];
+      if (stream.averager.passThrough())
+      {
+         return;
+      }
       for(i = 0; i < net->n; ++i)
       {
          layer l = net->layers[i];
          if(l.type == YOLO || l.type == REGION || l.type == DETECTION)
          {
-            memcpy(predictions_[demoIndex_] + count, net->layers[i].output, sizeof(float) * l.outputs);
+            // The camera's outputs are batch entry camera of the layer.
+            stream.averager.accumulate(count, net->layers[i].output + camera * l.outputs, l.outputs);
             count += l.outputs;
          }
       }
+      stream.averager.advance();
    }
 
-   detection *YoloObjectDetector::avgPredictions(network *net, int *nboxes)
+   detection *YoloObjectDetector::avgPredictions(network *net, int camera, int width, int height, int *nboxes)
    {
-      int i, j;
+      int i;
       int count = 0;
-      fill_cpu(demoTotal_, 0, avg_, 1);
+      const PredictionAverager& averager = cameras_[camera]->averager;
 
-      for(j = 0; j < demoFrame_; ++j)
+      // YOLO outputs are decoded where they are, only anchors over the threshold reach the arena.
+      if (decoder_.direct())
       {
-         axpy_cpu(demoTotal_, 1./demoFrame_, predictions_[j], 1, avg_, 1);
+         const float *avg = averager.passThrough() ? 0 : averager.average();
+         return decoder_.decode(net, camera, avg, width, height, demoThresh_, nboxes);
       }
 
-      for(i = 0; i < net->n; ++i)
+      // get_network_boxes decodes batch entry 0, which every camera has been remembered from by now.
+      // Without smoothing camera 0 decodes its live outputs in place, camera k only moves entry k there.
+      if (averager.passThrough())
       {
-         layer l = net->layers[i];
-         if(l.type == YOLO || l.type == REGION || l.type == DETECTION)
+         for(i = 0; camera > 0 && i < net->n; ++i)
          {
-            memcpy(l.output, avg_ + count, sizeof(float) * l.outputs);
-            count += l.outputs;
+            layer l = net->layers[i];
+            if(l.type == YOLO || l.type == REGION || l.type == DETECTION)
+            {
+               memcpy(l.output, l.output + camera * l.outputs, sizeof(float) * l.outputs);
+            }
          }
       }
-      detection *dets = get_network_boxes(net, buff_[0].w, buff_[0].h, demoThresh_, demoHier_, 0, 1, nboxes);
+      else
+      {
+         const float *avg = averager.average();
+         for(i = 0; i < net->n; ++i)
+         {
+            layer l = net->layers[i];
+            if(l.type == YOLO || l.type == REGION || l.type == DETECTION)
+            {
+               memcpy(l.output, avg + count, sizeof(float) * l.outputs);
+               count += l.outputs;
+            }
+         }
+      }
+      return networkBoxes(net, width, height, nboxes);
+   }
+
+   detection *YoloObjectDetector::networkBoxes(network *net, int width, int height, int *nboxes)
+   {
+      // With l.batch == 2 get_region_detections and avg_flipped_yolo treat entry 1 as the mirrored
+      // copy of entry 0 and average them. Our entries are other cameras or goals, so the output layers
+      // are decoded as a batch of 1 and get their batch back afterwards.
+      std::vector<int> batches(net->n);
+      for (int i = 0; i < net->n; ++i)
+      {
+         layer& l = net->layers[i];
+         batches[i] = l.batch;
+         if (l.type == YOLO || l.type == REGION || l.type == DETECTION)
+         {
+            l.batch = 1;
+         }
+      }
+      detection *dets = get_network_boxes(net, width, height, demoThresh_, demoHier_, 0, 1, nboxes);
+      for (int i = 0; i < net->n; ++i)
+      {
+         net->layers[i].batch = batches[i];
+      }
       return dets;
    }
 
-   void *YoloObjectDetector::detectInThread()
+   void YoloObjectDetector::releasePredictions(const DetectionDecoder& decoder, detection *dets, int nboxes)
    {
-      running_ = 1;
-      float nms = .4;
+      // The arena is reused, only get_network_boxes allocates.
+      if (!decoder.direct())
+      {
+         free_detections(dets, nboxes);
+      }
+   }
 
-      layer l = net_->layers[net_->n - 1];
-      float *X = buffLetter_[(buffIndex_ + 2) % 3].data;
-      float *prediction = network_predict(net_, X);
+   void *YoloObjectDetector::detectInThread(int slot)
+   {
+      running_ = 1;
 
-      rememberNetwork(net_);
-      detection *dets = 0;
-      int nboxes = 0;
-      dets = avgPredictions(net_, &nboxes);
+      // One forward pass for the whole batch, then the results fan out per camera.
+      float *X = slots_[slot].buffLetter.data;
+      float *prediction = predict(net_, X);
 
-      if (nms > 0) do_nms_obj(dets, nboxes, l.classes, nms);
+      std::vector<CameraView_>& views = slots_[slot].views;
+      for (size_t k = 0; k < views.size(); ++k)
+      {
+         if (views[k].fresh)
+         {
+            rememberNetwork(net_, k);
+         }
+      }
 
       if (enableConsoleOutput_)
       {
@@ -521,12 +764,38 @@ namespace darknet_ros
          printf("\nFPS:%.1f\n",fps_);
          printf("Objects:\n\n");
       }
-      image display = buff_[(buffIndex_+2) % 3];
-      draw_detections(display, dets, nboxes, demoThresh_, demoNames_, demoAlphabet_, demoClasses_);
+      for (size_t k = 0; k < views.size(); ++k)
+      {
+         if (views[k].fresh)
+         {
+            decodeCamera(slot, k);
+         }
+      }
+      running_ = 0;
+      return 0;
+   }
+
+   void YoloObjectDetector::decodeCamera(int slot, int camera)
+   {
+      layer l = net_->layers[net_->n - 1];
+      CameraView_& view = slots_[slot].views[camera];
+      detection *dets = 0;
+      int nboxes = 0;
+      const cv::Mat& rgb = view.frame.rgb->image;
+      dets = avgPredictions(net_, camera, rgb.cols, rgb.rows, &nboxes);
+
+      if (nmsThreshold_ > 0) nms_.apply(dets, nboxes, l.classes, demoThresh_);
 
       // Extract the bounding boxes and send them to ROS
+      extractBoxes(dets, nboxes, view.detections);
+
+      releasePredictions(decoder_, dets, nboxes);
+   }
+
+   void YoloObjectDetector::extractBoxes(detection *dets, int nboxes, DetectionBuffer& detections)
+   {
       int i, j;
-      int count = 0;
+      detections.clear();
       for (i = 0; i < nboxes; ++i)
       {
          float xmin = dets[i].bbox.x - dets[i].bbox.w / 2.;
@@ -556,51 +825,127 @@ namespace darknet_ros
                // Define bounding box - BoundingBox must be 1% size of frame (3.2x2.4 pixels)
                if (BoundingBox_width > 0.01 && BoundingBox_height > 0.01)
                {
-                  roiBoxes_[count].x = x_center;
-                  roiBoxes_[count].y = y_center;
-                  roiBoxes_[count].w = BoundingBox_width;
-                  roiBoxes_[count].h = BoundingBox_height;
-                  roiBoxes_[count].Class = j;
-                  roiBoxes_[count].prob = dets[i].prob[j];
-                  count++;
+                  detections.add(x_center, y_center, BoundingBox_width, BoundingBox_height, dets[i].prob[j], j);
                }
             }
          }
       }
-
-      // Create array to store found bounding boxes
-      // If no object detected, make sure that ROS knows that num = 0
-      if (count == 0) 
+      detections.finish();
+      if (detections.dropped() > 0)
       {
-         roiBoxes_[0].num = 0;
+         ROS_DEBUG("[YoloObjectDetector] %zu detections over the buffer or top_k dropped.", detections.dropped());
       }
-      else
+   }
+
+   size_t YoloObjectDetector::detectionCapacity(network *net)
+   {
+      size_t count = 0;
+      for (int i = 0; i < net->n; ++i)
       {
-         roiBoxes_[0].num = count;
+         layer l = net->layers[i];
+         if (l.type == YOLO || l.type == REGION)
+         {
+            count += l.w * l.h * l.n;
+         }
+         else if (l.type == DETECTION)
+         {
+            count += l.side * l.side * l.n;
+         }
       }
+      return count;
+   }
 
-      free_detections(dets, nboxes);
-      demoIndex_ = (demoIndex_ + 1) % demoFrame_;
-      running_ = 0;
+   void *YoloObjectDetector::fetchInThread(int slot, int camera, const CameraFrame_& frame)
+   {
+      CameraView_& view = slots_[slot].views[camera];
+      view.frame = frame;
+
+      // The network input is resized straight from BGR8 into the camera's batch entry, drawing uses the frame itself.
+      const cv::Mat& rgb = frame.rgb->image;
+      image boxed = slots_[slot].buffLetter;
+      boxed.c = 3;
+      boxed.data += (size_t) camera * boxed.w * boxed.h * 3;
+      if (!bgr8_letterbox_into(rgb.data, rgb.cols, rgb.rows, rgb.step, boxed, &cameras_[camera]->letterbox))
+      {
+         ROS_ERROR_THROTTLE(1, "[YoloObjectDetector] Out of memory letterboxing %s.", cameras_[camera]->ns.c_str());
+      }
       return 0;
    }
 
-   void *YoloObjectDetector::fetchInThread()
+   cv::Scalar YoloObjectDetector::classColour(int classId) const
    {
-      IplImage* ROS_img = getIplImage();
-      ipl_into_image(ROS_img, buff_[buffIndex_]);
+      // get_color() of darknet's image.c, interpolated over its six colours.
+      static const float colours[6][3] = { {1,0,1}, {0,0,1}, {0,1,1}, {0,1,0}, {1,1,0}, {1,0,0} };
+      int classes = std::max(demoClasses_, 1);
+      int offset = classId * 123457 % classes;
+      float rgb[3];
+      for (int c = 0; c < 3; ++c)
       {
-         boost::shared_lock<boost::shared_mutex> lock(mutexImageCallback_);
-         buffId_[buffIndex_] = actionId_;
+         float ratio = ((float) offset / classes) * 5;
+         int i = floor(ratio);
+         int j = ceil(ratio);
+         ratio -= i;
+         rgb[c] = (1 - ratio) * colours[i][c] + ratio * colours[j][c];
       }
-      rgbgr_image(buff_[buffIndex_]);
-      letterbox_image_into(buff_[buffIndex_], net_->w, net_->h, buffLetter_[buffIndex_]);
-      return 0;
+      // darknet's red is get_color(2), its blue get_color(0).
+      return cv::Scalar(255 * rgb[0], 255 * rgb[1], 255 * rgb[2]);
    }
 
-   void *YoloObjectDetector::displayInThread(void *ptr)
+   void YoloObjectDetector::renderDetections(CameraView_& view)
    {
-      show_image_cv(buff_[(buffIndex_ + 1)%3], "YOLO V3", ipl_);
+      const DetectionBuffer& detections = view.detections;
+      if (renderMode_ == RENDER_OVERLAY)
+      {
+         cv::Mat& render = view.render;
+         overlay_.begin(view.frame.rgb->image, render);
+         for (size_t i = 0; i < detections.size(); ++i)
+         {
+            int classId = detections.classId(i);
+            int xmin = (detections.x(i) - detections.w(i) / 2) * render.cols;
+            int ymin = (detections.y(i) - detections.h(i) / 2) * render.rows;
+            int xmax = (detections.x(i) + detections.w(i) / 2) * render.cols;
+            int ymax = (detections.y(i) + detections.h(i) / 2) * render.rows;
+            cv::Scalar colour = classColour(classId);
+            const uint8_t bgr[3] = {(uint8_t) colour[0], (uint8_t) colour[1], (uint8_t) colour[2]};
+            overlay_.drawBox(render, xmin, ymin, xmax, ymax, bgr);
+            overlay_.drawLabel(render, xmin, ymin, classLabels_[classId].c_str(), bgr);
+            if (drawAxes_)
+            {
+               overlay_.drawAxes(render, xmin, ymin, xmax, ymax);
+            }
+         }
+         return;
+      }
+
+      // copyTo keeps the allocation of the previous frame of the same size.
+      view.frame.rgb->image.copyTo(view.render);
+      cv::Mat& render = view.render;
+      int thickness = std::max((int) (render.rows * .006), 1);
+      for (size_t i = 0; i < detections.size(); ++i)
+      {
+         int classId = detections.classId(i);
+         int xmin = std::max((int) ((detections.x(i) - detections.w(i) / 2) * render.cols), 0);
+         int ymin = std::max((int) ((detections.y(i) - detections.h(i) / 2) * render.rows), 0);
+         int xmax = std::min((int) ((detections.x(i) + detections.w(i) / 2) * render.cols), render.cols - 1);
+         int ymax = std::min((int) ((detections.y(i) + detections.h(i) / 2) * render.rows), render.rows - 1);
+         cv::Scalar colour = classColour(classId);
+         cv::rectangle(render, cv::Point(xmin, ymin), cv::Point(xmax, ymax), colour, thickness);
+
+         // Label on a filled bar above the box, or inside it at the top edge.
+         const std::string& label = classLabels_[classId];
+         int baseline = 0;
+         cv::Size text = cv::getTextSize(label, cv::FONT_HERSHEY_SIMPLEX, .5, 1, &baseline);
+         int top = ymin - text.height - baseline >= 0 ? ymin - text.height - baseline : ymin;
+         cv::rectangle(render, cv::Point(xmin, top), cv::Point(xmin + text.width, top + text.height + baseline), colour, CV_FILLED);
+         cv::putText(render, label, cv::Point(xmin, top + text.height), cv::FONT_HERSHEY_SIMPLEX, .5, cv::Scalar(0, 0, 0), 1);
+      }
+   }
+
+   void *YoloObjectDetector::displayInThread(int slot, int camera)
+   {
+      CameraView_& view = slots_[slot].views[camera];
+      std::string window = camera == 0 ? std::string("YOLO V3") : "YOLO V3 " + std::to_string(camera);
+      cv::imshow(window, view.render);
       int c = cvWaitKey(waitKeyDelay_);
       if (c != -1) c = c%256;
       if (c == 27)
@@ -629,19 +974,246 @@ namespace darknet_ros
       return 0;
    }
 
-   void *YoloObjectDetector::displayLoop(void *ptr)
+   void *YoloObjectDetector::fetchLoop()
+   {
+      int slot;
+      while (freeQueue_.pop(slot))
+      {
+         claimSlot(slot, SLOT_FETCH);
+         double service = 0;
+         if (!waitForFrames(slot, service))
+         {
+            break;
+         }
+         double now = what_time_is_it_now();
+         fetchStats_.record(now - slots_[slot].queuedTime - service, service);
+         slots_[slot].queuedTime = now;
+         if (!detectQueue_.push(slot))
+         {
+            break;
+         }
+      }
+      detectQueue_.close();
+      return 0;
+   }
+
+   void *YoloObjectDetector::detectLoop()
+   {
+      bool first = true;
+      int slot;
+      while (detectQueue_.pop(slot))
+      {
+         claimSlot(slot, SLOT_DETECT);
+         double start = what_time_is_it_now();
+         double wait = start - slots_[slot].queuedTime;
+         detectInThread(slot);
+         slots_[slot].queuedTime = what_time_is_it_now();
+         detectStats_.record(wait, slots_[slot].queuedTime - start);
+         if (first)
+         {
+            // Cold start breakdown, the first inference includes the lazy allocations of the backend.
+            ROS_INFO("[YoloObjectDetector] startup: weights %.1f ms, offline network %.1f ms, glyphs compiled in, first frame after %.1f ms, "
+                     "first inference %.1f ms, %.1f ms to the first detection.", startupWeights_ * 1000., startupOffline_ * 1000.,
+                     startupFirstFrame_ * 1000., (slots_[slot].queuedTime - start) * 1000., (slots_[slot].queuedTime - startupTime_) * 1000.);
+            first = false;
+         }
+         if (!publishQueue_.push(slot))
+         {
+            break;
+         }
+      }
+      publishQueue_.close();
+      return 0;
+   }
+
+   void YoloObjectDetector::publishLoop()
+   {
+      int count = 0;
+      int slot;
+      while (!demoDone_ && publishQueue_.pop(slot))
+      {
+         claimSlot(slot, SLOT_PUBLISH);
+         double start = what_time_is_it_now();
+         double wait = start - slots_[slot].queuedTime;
+         if (!demoPrefix_)
+         {
+            fps_ = 1./(start - demoTime_);
+            demoTime_ = start;
+         }
+         for (size_t k = 0; k < cameras_.size(); ++k)
+         {
+            if (!slots_[slot].views[k].fresh)
+            {
+               continue;
+            }
+            // Nothing is drawn unless the image is shown, subscribed to or saved.
+            CameraView_& view = slots_[slot].views[k];
+            if (!demoPrefix_)
+            {
+               bool subscribed = cameras_[k]->detectionImagePublisher.getNumSubscribers() > 0;
+               if (viewImage_ || subscribed)
+               {
+                  renderDetections(view);
+               }
+               if (viewImage_)
+               {
+                  displayInThread(slot, k);
+               }
+               if (!subscribed || !publishDetectionImage(view.render, cameras_[k]->detectionImagePublisher))
+               {
+                  ROS_DEBUG("Detection image has not been broadcasted.");
+               }
+            }
+            else
+            {
+               char name[256];
+               if (k == 0)
+                  sprintf(name, "%s_%08d.jpg", demoPrefix_, count);
+               else
+                  sprintf(name, "%s_%zu_%08d.jpg", demoPrefix_, k, count);
+               renderDetections(view);
+               cv::imwrite(name, view.render);
+            }
+         }
+         slots_[slot].queuedTime = what_time_is_it_now();
+         publishStats_.record(wait, slots_[slot].queuedTime - start);
+         if (!poseQueue_.push(slot))
+         {
+            break;
+         }
+         reportPipelineStats();
+         ++count;
+         if (!isNodeRunning())
+         {
+            demoDone_ = true;
+         }
+      }
+      poseQueue_.close();
+   }
+
+   void *YoloObjectDetector::poseLoop()
    {
-      while (1)
+      // Depth and 3D work of a batch overlaps the display of the next one and the inference after it.
+      int slot;
+      while (poseQueue_.pop(slot))
       {
-         displayInThread(0);
+         claimSlot(slot, SLOT_POSE);
+         double start = what_time_is_it_now();
+         double wait = start - slots_[slot].queuedTime;
+         if (!demoPrefix_)
+         {
+            for (size_t k = 0; k < cameras_.size(); ++k)
+            {
+               if (slots_[slot].views[k].fresh)
+               {
+                  poseInThread(slot, k);
+               }
+            }
+         }
+         slots_[slot].queuedTime = what_time_is_it_now();
+         poseStats_.record(wait, slots_[slot].queuedTime - start);
+         if (!freeQueue_.push(slot))
+         {
+            break;
+         }
       }
+      freeQueue_.close();
+      return 0;
+   }
+
+   YoloObjectDetector::SlotStage YoloObjectDetector::previousStage(SlotStage stage)
+   {
+      // The ring FETCH -> DETECT -> PUBLISH -> POSE -> FETCH, a slot back in the free queue is still owned by POSE.
+      return stage == SLOT_FETCH ? SLOT_POSE : static_cast<SlotStage>(stage - 1);
    }
 
-   void *YoloObjectDetector::detectLoop(void *ptr)
+   void YoloObjectDetector::claimSlot(int slot, SlotStage to)
    {
-      while (1)
+      SlotStage from = previousStage(to);
+      if (!slotOwners_.transfer(slot, from, to))
       {
-         detectInThread();
+         ++slotClaimFailures_;
+         ROS_ERROR("[YoloObjectDetector] Slot %d handed to stage %d while owned by stage %d, expected %d.", slot, to, slotOwners_.owner(slot), from);
+      }
+   }
+
+   bool YoloObjectDetector::checkSlotRing()
+   {
+      // Two full cycles of a scratch slot from the initial owner, the second one catches a ring that does not close.
+      SlotOwnership owners(1, SLOT_POSE);
+      const SlotStage order[4] = {SLOT_FETCH, SLOT_DETECT, SLOT_PUBLISH, SLOT_POSE};
+      for (int k = 0; k < 8; ++k)
+      {
+         if (!owners.transfer(0, previousStage(order[k % 4]), order[k % 4]))
+         {
+            return false;
+         }
+      }
+      return true;
+   }
+
+   void YoloObjectDetector::reportPipelineStats()
+   {
+      double now = what_time_is_it_now();
+      if (statsPeriod_ <= 0 || now - lastStatsTime_ < statsPeriod_)
+      {
+         return;
+      }
+      lastStatsTime_ = now;
+
+      const char *names[4] = {"fetch", "detect", "publish", "pose"};
+      StageStats *stats[4] = {&fetchStats_, &detectStats_, &publishStats_, &poseStats_};
+      size_t depths[4] = {freeQueue_.size(), detectQueue_.size(), publishQueue_.size(), poseQueue_.size()};
+      if (slotClaimFailures_.load() > 0)
+      {
+         ROS_WARN("[YoloObjectDetector] %lu slot hand-offs to a stage that did not own the slot.", slotClaimFailures_.load());
+      }
+      for (size_t k = 0; k < cameras_.size(); ++k)
+      {
+         uint64_t received, dropped, duplicates;
+         cameras_[k]->mailbox.counters(received, dropped, duplicates);
+         ROS_INFO("[YoloObjectDetector] %s frames received %lu, dropped %lu, duplicates %lu.", cameras_[k]->ns.c_str(),
+                  (unsigned long) received, (unsigned long) dropped, (unsigned long) duplicates);
+      }
+      for (int i = 0; i < 4; ++i)
+      {
+         unsigned long frames;
+         double waitAvg, serviceAvg, serviceMax;
+         stats[i]->snapshot(frames, waitAvg, serviceAvg, serviceMax);
+         ROS_INFO("[YoloObjectDetector] %-7s queue %zu/%d, wait %.1f ms, service %.1f ms (max %.1f ms), %lu frames.",
+                  names[i], depths[i], numSlots_, waitAvg * 1000., serviceAvg * 1000., serviceMax * 1000., frames);
+      }
+   }
+
+   void YoloObjectDetector::reportOfflineStats()
+   {
+      double now = what_time_is_it_now();
+      if (statsPeriod_ <= 0 || now - lastOfflineStatsTime_ < statsPeriod_)
+      {
+         return;
+      }
+      lastOfflineStatsTime_ = now;
+
+      unsigned long goals;
+      double waitAvg, serviceAvg, serviceMax;
+      offlineStats_.snapshot(goals, waitAvg, serviceAvg, serviceMax);
+      ROS_INFO("[YoloObjectDetector] offline queue %zu/%zu, wait %.1f ms, service %.1f ms (max %.1f ms), %lu goals, %lu aborted, %lu canceled.",
+               offlineQueue_->size(), offlineQueue_->capacity(), waitAvg * 1000., serviceAvg * 1000., serviceMax * 1000., goals,
+               offlineAborted_.load(), offlineCanceled_.load());
+   }
+
+   void YoloObjectDetector::pinThread(pthread_t thread, int cpu, const char *name)
+   {
+      if (cpu < 0)
+      {
+         return;
+      }
+      cpu_set_t cpuset;
+      CPU_ZERO(&cpuset);
+      CPU_SET(cpu, &cpuset);
+      if (pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpuset) != 0)
+      {
+         ROS_WARN("[YoloObjectDetector] Could not pin %s stage to cpu %d.", name, cpu);
       }
    }
 
@@ -650,119 +1222,416 @@ namespace darknet_ros
       demoPrefix_ = prefix;
       demoDelay_ = delay;
       demoFrame_ = avg_frames;
-      image **alphabet = load_alphabet_with_file(datafile);
+      // No glyphs are loaded, the overlay font is compiled in and OpenCV brings its own.
       demoNames_ = names;
-      demoAlphabet_ = alphabet;
       demoClasses_ = classes;
       demoThresh_ = thresh;
       demoHier_ = hier;
       fullScreen_ = fullscreen;
       printf("YOLO V3\n");
-      net_ = load_network(cfgfile, weightfile, 0);
-      set_batch_network(net_, 1);
+      double start = what_time_is_it_now();
+      net_ = loadNetwork(cfgfile, weightfile);
+      startupWeights_ = what_time_is_it_now() - start;
+      start = what_time_is_it_now();
+
+      // One batch entry per camera; the buffers allocated for the cfg batch are resized to it.
+      set_batch_network(net_, cameras_.size());
+      if (cameras_.size() > 1)
+      {
+         resize_network(net_, net_->w, net_->h);
+      }
+
+      // The offline lane runs its own batch on the same weights; only the activations are duplicated.
+      offlineNet_ = parse_network_cfg(cfgfile);
+      set_batch_network(offlineNet_, offlineBatch_);
+      resize_network(offlineNet_, net_->w, net_->h);
+      if (!shareNetworkWeights(offlineNet_, net_))
+      {
+         ROS_WARN("[YoloObjectDetector] Layer weights of %s cannot be shared, loading them again for the action goals.", cfgfile);
+         load_weights(offlineNet_, weightfile);
+      }
+      startupOffline_ = what_time_is_it_now() - start;
    }
 
-   void YoloObjectDetector::yolo()
+   network *YoloObjectDetector::loadNetwork(char *cfgfile, char *weightfile)
    {
-      const auto wait_duration = std::chrono::milliseconds(2000);
-      while (!getImageStatus())
+      WeightCacheSource source;
+      if (weightCachePath_.empty() || !source.read(cfgfile, weightfile))
       {
-         printf("Waiting for image.\n");
-         if (!isNodeRunning())
+         return load_network(cfgfile, weightfile, 0);
+      }
+
+      // A missing or stale cache is rebuilt from the weights file and mapped like a valid one.
+      network *net = parse_network_cfg(cfgfile);
+      if (!weightCache_.map(weightCachePath_, source) || !weightCache_.attach(net))
+      {
+         ROS_INFO("[YoloObjectDetector] Building weight cache %s.", weightCachePath_.c_str());
+         load_weights(net, weightfile);
+         if (!WeightCache::write(weightCachePath_, net, source) || !weightCache_.map(weightCachePath_, source) || !weightCache_.attach(net))
          {
-            return;
+            ROS_WARN("[YoloObjectDetector] Could not use weight cache %s, keeping the weights in private memory.", weightCachePath_.c_str());
+            return net;
          }
-         std::this_thread::sleep_for(wait_duration);
       }
+#ifdef GPU
+      // load_weights pushes every layer it reads, the mapped host arrays still have to reach the device.
+      if (gpu_index >= 0)
+      {
+         for (int i = 0; i < net->n; ++i)
+         {
+            layer l = net->layers[i];
+            if (l.type == CONVOLUTIONAL)
+               push_convolutional_layer(l);
+            else if (l.type == DECONVOLUTIONAL)
+               push_deconvolutional_layer(l);
+            else if (l.type == CONNECTED)
+               push_connected_layer(l);
+            else if (l.type == BATCHNORM)
+               push_batchnorm_layer(l);
+         }
+      }
+#endif
+      ROS_INFO("[YoloObjectDetector] Weights mapped from %s.", weightCachePath_.c_str());
+      return net;
+   }
 
-      std::thread detect_thread;
-      std::thread fetch_thread;
-
-      srand(2222222);
-
-      int i;
-      demoTotal_ = sizeNetwork(net_);
-      predictions_ = (float **) calloc(demoFrame_, sizeof(float*));
-
-      for (i = 0; i < demoFrame_; ++i)
+   // Frees the array of dst and points it at the one of src.
+   static void shareArray(float *&dst, float *src)
+   {
+      if (dst != src)
       {
-         predictions_[i] = (float *) calloc(demoTotal_, sizeof(float));
+         free(dst);
+         dst = src;
       }
+   }
 
-      avg_ = (float *) calloc(demoTotal_, sizeof(float));
+#ifdef GPU
+   static void shareArrayGpu(float *&dst, float *src)
+   {
+      if (dst != src)
+      {
+         if (dst) cuda_free(dst);
+         dst = src;
+      }
+   }
+#endif
 
-      layer l = net_->layers[net_->n - 1];
-      roiBoxes_ = (darknet_ros::RosBox_ *) calloc(l.w * l.h * l.n, sizeof(darknet_ros::RosBox_));
+   bool YoloObjectDetector::shareNetworkWeights(network *dst, network *src)
+   {
+      if (dst->n != src->n)
+      {
+         return false;
+      }
+      // Checked in full before the first layer is touched: a refusal leaves dst with its own arrays, which
+      // load_weights can then fill without writing into src (mapped read-only when it comes from the weight cache).
+      for (int i = 0; i < dst->n; ++i)
+      {
+         const layer& d = dst->layers[i];
+         if (d.type != src->layers[i].type)
+         {
+            return false;
+         }
+         if (d.type == LOCAL || d.type == RNN || d.type == GRU || d.type == LSTM || d.type == CRNN)
+         {
+            // Recurrent layers keep their weights in sub-layers, those are not shared.
+            return false;
+         }
+      }
+      for (int i = 0; i < dst->n; ++i)
+      {
+         layer& d = dst->layers[i];
+         layer& s = src->layers[i];
+         if (d.type == CONVOLUTIONAL || d.type == DECONVOLUTIONAL || d.type == CONNECTED || d.type == BATCHNORM)
+         {
+            shareArray(d.weights, s.weights);
+            shareArray(d.biases, s.biases);
+            shareArray(d.scales, s.scales);
+            shareArray(d.rolling_mean, s.rolling_mean);
+            shareArray(d.rolling_variance, s.rolling_variance);
+#ifdef GPU
+            shareArrayGpu(d.weights_gpu, s.weights_gpu);
+            shareArrayGpu(d.biases_gpu, s.biases_gpu);
+            shareArrayGpu(d.scales_gpu, s.scales_gpu);
+            shareArrayGpu(d.rolling_mean_gpu, s.rolling_mean_gpu);
+            shareArrayGpu(d.rolling_variance_gpu, s.rolling_variance_gpu);
+#endif
+         }
+      }
+      return true;
+   }
 
-      IplImage* ROS_img = getIplImage();
-      buff_[0] = ipl_to_image(ROS_img);
-      buff_[1] = copy_image(buff_[0]);
-      buff_[2] = copy_image(buff_[0]);
-      buffLetter_[0] = letterbox_image(buff_[0], net_->w, net_->h);
-      buffLetter_[1] = letterbox_image(buff_[0], net_->w, net_->h);
-      buffLetter_[2] = letterbox_image(buff_[0], net_->w, net_->h);
-      ipl_ = cvCreateImage(cvSize(buff_[0].w, buff_[0].h), IPL_DEPTH_8U, buff_[0].c);
+   float *YoloObjectDetector::predict(network *net, float *input)
+   {
+#ifdef GPU
+      // net_ and offlineNet_ share device weights, the cuBLAS handle and the default stream, darknet cannot run them concurrently.
+      if (gpu_index >= 0)
+      {
+         std::lock_guard<std::mutex> lock(gpuMutex_);
+         return network_predict(net, input);
+      }
+#endif
+      // On the CPU each network only writes its own activations and workspace, the two lanes run in parallel.
+      return network_predict(net, input);
+   }
 
-      int count = 0;
+   void YoloObjectDetector::offlineLoop()
+   {
+      pinThread(pthread_self(), offlineCpu_, "offline");
+      image input = make_image(offlineNet_->w, offlineNet_->h, 3 * offlineBatch_);
+      letterbox_scratch letterbox = make_letterbox_scratch();
+      offlineDetections_.reset(detectionCapacity(offlineNet_), numClasses_, detectionTopK_);
+      offlineDecoder_.reset(offlineNet_);
+      std::vector<OfflineRequest_> batch;
+      lastOfflineStatsTime_ = what_time_is_it_now();
+      while (offlineQueue_->popBatch(batch, offlineBatch_, std::chrono::duration<double>(offlineBatchTimeout_)))
+      {
+         detectOffline(batch, input, letterbox);
+         reportOfflineStats();
+      }
+      free_image(input);
+      free_letterbox_scratch(&letterbox);
+   }
 
-      if (!demoPrefix_ && viewImage_)
+   void YoloObjectDetector::detectOffline(const std::vector<OfflineRequest_>& requests, image input, letterbox_scratch& letterbox)
+   {
+      // Goals canceled or past their deadline are dropped before they cost a batch entry.
+      double start = what_time_is_it_now();
+      std::vector<OfflineRequest_> batch;
+      for (size_t b = 0; b < requests.size(); ++b)
       {
-         cvNamedWindow("YOLO V3", CV_WINDOW_NORMAL);
-         if (fullScreen_)
+         CheckForObjectsGoalHandle goal = requests[b].goal;
+         if (goal.getGoalStatus().status != actionlib_msgs::GoalStatus::ACTIVE)
          {
-            cvSetWindowProperty("YOLO V3", CV_WND_PROP_FULLSCREEN, CV_WINDOW_FULLSCREEN);
+            continue;
          }
-         else
+         if (offlineDeadline_ > 0 && start - requests[b].queuedTime > offlineDeadline_)
          {
-            cvMoveWindow("YOLO V3", 0, 0);
-            cvResizeWindow("YOLO V3", 640, 480);
+            darknet_ros_msgs::CheckForObjectsResult objectsActionResult;
+            objectsActionResult.id = requests[b].id;
+            std::lock_guard<std::mutex> lock(offlineGoalMutex_);
+            if (goal.getGoalStatus().status == actionlib_msgs::GoalStatus::ACTIVE)
+            {
+               goal.setAborted(objectsActionResult, "Deadline exceeded.");
+               ++offlineAborted_;
+            }
+            continue;
          }
+         batch.push_back(requests[b]);
+      }
+      if (batch.empty())
+      {
+         return;
       }
 
-      demoTime_ = what_time_is_it_now();
+      // Request b is letterboxed into batch entry b, entries past the batch keep stale pixels nobody reads.
+      for (size_t b = 0; b < batch.size(); ++b)
+      {
+         const cv::Mat& rgb = batch[b].image->image;
+         image boxed = input;
+         boxed.c = 3;
+         boxed.data += b * input.w * input.h * 3;
+         if (!bgr8_letterbox_into(rgb.data, rgb.cols, rgb.rows, rgb.step, boxed, &letterbox))
+         {
+            ROS_ERROR_THROTTLE(1, "[YoloObjectDetector] Out of memory letterboxing goal %d.", batch[b].id);
+         }
+      }
+      predict(offlineNet_, input.data);
 
-      while (!demoDone_)
+      layer last = offlineNet_->layers[offlineNet_->n - 1];
+      const DetectionBuffer& detections = offlineDetections_;
+      for (size_t b = 0; b < batch.size(); ++b)
       {
-         buffIndex_ = (buffIndex_ + 1) % 3;
-         fetch_thread = std::thread(&YoloObjectDetector::fetchInThread, this);
-         detect_thread = std::thread(&YoloObjectDetector::detectInThread, this);
-         if (!demoPrefix_)
+         const cv::Mat& rgb = batch[b].image->image;
+         int nboxes = 0;
+         detection *dets;
+         if (offlineDecoder_.direct())
+         {
+            dets = offlineDecoder_.decode(offlineNet_, b, 0, rgb.cols, rgb.rows, demoThresh_, &nboxes);
+         }
+         else
          {
-            fps_ = 1./(what_time_is_it_now() - demoTime_);
-            demoTime_ = what_time_is_it_now();
-            if (viewImage_)
+            // get_network_boxes decodes batch entry 0, which is done with once entry b moves in.
+            for (int i = 0; b > 0 && i < offlineNet_->n; ++i)
             {
-               displayInThread(0);
+               layer l = offlineNet_->layers[i];
+               if (l.type == YOLO || l.type == REGION || l.type == DETECTION)
+               {
+                  memcpy(l.output, l.output + b * l.outputs, sizeof(float) * l.outputs);
+               }
             }
-            publishInThread();
+            dets = networkBoxes(offlineNet_, rgb.cols, rgb.rows, &nboxes);
          }
-         else
+         if (nmsThreshold_ > 0) offlineNms_.apply(dets, nboxes, last.classes, demoThresh_);
+         extractBoxes(dets, nboxes, offlineDetections_);
+         releasePredictions(offlineDecoder_, dets, nboxes);
+
+         darknet_ros_msgs::CheckForObjectsResult objectsActionResult;
+         objectsActionResult.id = batch[b].id;
+         objectsActionResult.bounding_boxes.header.stamp = ros::Time::now();
+         objectsActionResult.bounding_boxes.header.frame_id = "detection";
+         objectsActionResult.bounding_boxes.image_header = batch[b].image->header;
+         for (size_t i = 0; i < detections.size(); ++i)
          {
-            char name[256];
-            sprintf(name, "%s_%08d", demoPrefix_, count);
-            save_image(buff_[(buffIndex_ + 1) % 3], name);
+            // Goal images carry no depth, so no position either.
+            darknet_ros_msgs::BoundingBox boundingBox;
+            boundingBox.Class = classLabels_[detections.classId(i)];
+            boundingBox.probability = detections.prob(i);
+            boundingBox.xmin = (detections.x(i) - detections.w(i) / 2) * rgb.cols;
+            boundingBox.ymin = (detections.y(i) - detections.h(i) / 2) * rgb.rows;
+            boundingBox.xmax = (detections.x(i) + detections.w(i) / 2) * rgb.cols;
+            boundingBox.ymax = (detections.y(i) + detections.h(i) / 2) * rgb.rows;
+            boundingBox.Invalid = true;
+            objectsActionResult.bounding_boxes.bounding_boxes.push_back(boundingBox);
          }
-         fetch_thread.join();
-         detect_thread.join();
-         ++count;
-         if (!isNodeRunning())
+
+         // Checked and answered under the cancel callback's lock, a goal canceled meanwhile is not also succeeded.
+         CheckForObjectsGoalHandle goal = batch[b].goal;
+         std::lock_guard<std::mutex> lock(offlineGoalMutex_);
+         if (goal.getGoalStatus().status == actionlib_msgs::GoalStatus::ACTIVE)
          {
-            demoDone_ = true;
+            ROS_DEBUG("[YoloObjectDetector] check for objects in image %d.", batch[b].id);
+            goal.setSucceeded(objectsActionResult, "Send bounding boxes.");
+            offlineStats_.record(start - batch[b].queuedTime, what_time_is_it_now() - start);
          }
       }
    }
 
-   IplImage* YoloObjectDetector::getIplImage()
+   void YoloObjectDetector::yolo()
    {
-      boost::shared_lock<boost::shared_mutex> lock(mutexImageCallback_);
-      IplImage* ROS_img = new IplImage(camImageCopy_);
-      return ROS_img;
+      // Wait for the first frame of any camera, the buffers follow the frame sizes.
+      const auto wait_duration = std::chrono::milliseconds(2000);
+      uint64_t seen = 0;
+      while (!frameSignal_.wait(seen, wait_duration))
+      {
+         printf("Waiting for image.\n");
+         if (!isNodeRunning())
+         {
+            return;
+         }
+      }
+      startupFirstFrame_ = what_time_is_it_now() - startupTime_;
+
+      srand(2222222);
+
+      int i;
+      demoTotal_ = sizeNetwork(net_);
+      decoder_.reset(net_);
+      for (size_t k = 0; k < cameras_.size(); ++k)
+      {
+         cameras_[k]->averager.reset(demoTotal_, demoFrame_, averagingMode_, averagingDecay_);
+      }
+
+      for (i = 0; i < numSlots_; ++i)
+      {
+         slots_[i].buffLetter = make_image(net_->w, net_->h, 3 * cameras_.size());
+         slots_[i].views.resize(cameras_.size());
+         for (size_t k = 0; k < cameras_.size(); ++k)
+         {
+            CameraView_& view = slots_[i].views[k];
+            view.detections.reset(detectionCapacity(net_), numClasses_, detectionTopK_);
+            view.fresh = false;
+         }
+         slots_[i].queuedTime = what_time_is_it_now();
+         freeQueue_.push(i);
+      }
+
+      if (!demoPrefix_ && viewImage_)
+      {
+         for (size_t k = 0; k < cameras_.size(); ++k)
+         {
+            std::string window = k == 0 ? std::string("YOLO V3") : "YOLO V3 " + std::to_string(k);
+            cvNamedWindow(window.c_str(), CV_WINDOW_NORMAL);
+            if (fullScreen_)
+            {
+               cvSetWindowProperty(window.c_str(), CV_WND_PROP_FULLSCREEN, CV_WINDOW_FULLSCREEN);
+            }
+            else
+            {
+               cvMoveWindow(window.c_str(), 640 * k, 0);
+               cvResizeWindow(window.c_str(), 640, 480);
+            }
+         }
+      }
+
+      demoTime_ = what_time_is_it_now();
+      lastStatsTime_ = demoTime_;
+
+      if (!checkSlotRing())
+      {
+         ROS_ERROR("[YoloObjectDetector] Pipeline slots cannot complete a fetch -> detect -> publish -> pose cycle.");
+      }
+
+      // Long-lived stages: fetch, detect and pose run on their own threads, this thread displays and publishes images.
+      fetchThread_ = std::thread(&YoloObjectDetector::fetchLoop, this);
+      detectThread_ = std::thread(&YoloObjectDetector::detectLoop, this);
+      poseThread_ = std::thread(&YoloObjectDetector::poseLoop, this);
+      pinThread(fetchThread_.native_handle(), fetchCpu_, "fetch");
+      pinThread(detectThread_.native_handle(), detectCpu_, "detect");
+      pinThread(poseThread_.native_handle(), poseCpu_, "pose");
+      pinThread(pthread_self(), publishCpu_, "publish");
+
+      publishLoop();
+
+      detectQueue_.close();
+      publishQueue_.close();
+      poseQueue_.close();
+      freeQueue_.close();
+      frameSignal_.close();
+      fetchThread_.join();
+      detectThread_.join();
+      poseThread_.join();
    }
 
-   bool YoloObjectDetector::getImageStatus(void)
+   bool YoloObjectDetector::waitForFrames(int slot, double& service)
    {
-      boost::shared_lock<boost::shared_mutex> lock(mutexImageStatus_);
-      return imageStatus_;
+      // Takes the new frame of every camera; once the first one is in, the others get gatherTimeout_ to arrive.
+      std::vector<CameraView_>& views = slots_[slot].views;
+      size_t fresh = 0;
+      double deadline = 0;
+      uint64_t seen = frameSignal_.count();
+      for (size_t k = 0; k < views.size(); ++k)
+      {
+         views[k].fresh = false;
+      }
+      while (true)
+      {
+         for (size_t k = 0; k < views.size(); ++k)
+         {
+            CameraFrame_ frame;
+            uint64_t seq = 0;
+            if (!views[k].fresh && cameras_[k]->mailbox.take(frame, seq, std::chrono::milliseconds(0)))
+            {
+               // Set after the copy, take() writes the frame and the sequence number separately.
+               frame.seq = seq;
+               double start = what_time_is_it_now();
+               fetchInThread(slot, k, frame);
+               service += what_time_is_it_now() - start;
+               views[k].fresh = true;
+               if (fresh++ == 0)
+               {
+                  deadline = what_time_is_it_now() + gatherTimeout_;
+               }
+            }
+         }
+         if (fresh == views.size())
+         {
+            return true;
+         }
+         if (!isNodeRunning() || demoDone_)
+         {
+            return false;
+         }
+         double timeout = .1;
+         if (fresh > 0)
+         {
+            timeout = deadline - what_time_is_it_now();
+            if (timeout <= 0)
+            {
+               return true;
+            }
+         }
+         frameSignal_.wait(seen, std::chrono::duration<double>(timeout));
+      }
    }
 
    bool YoloObjectDetector::isNodeRunning(void)
@@ -772,9 +1641,7 @@ namespace darknet_ros
    }
 
    cv::Vec3f YoloObjectDetector::getDepth(const cv::Mat & depthImage,
-				   int x, int y,
-				   float cx, float cy,
-				   float fx, float fy)
+				   int x, int y)
 {
 	if(!(x >=0 && x<depthImage.cols && y >=0 && y<depthImage.rows))
 	{
@@ -790,21 +1657,23 @@ namespace darknet_ros
 
 	cv::Vec3f pt;
 
-	// Use correct principal point from calibration
-	float center_x = cx; //cameraInfo.K.at(2)
-	float center_y = cy; //cameraInfo.K.at(5)
-
 	bool isInMM = depthImage.type() == CV_16UC1; // is in mm?
 
-	// Combine unit conversion (if necessary) with scaling by focal length for computing (X,Y)
+	// Unit conversion (if necessary), the rays come from the frame's camera_info
 	float unit_scaling = isInMM?0.001f:1.0f;
-	float constant_x = unit_scaling / fx; //cameraInfo.K.at(0)
-	float constant_y = unit_scaling / fy; //cameraInfo.K.at(4)
 	float bad_point = std::numeric_limits<float>::quiet_NaN ();
 
 	float depth;
 	bool isValid;
-	if(isInMM)
+	if(depthProbeRadius_ > 0)
+	{
+		// Mean of the valid depth around the point, O(1) once the frame integral is built.
+		cv::Rect window(x - depthProbeRadius_, y - depthProbeRadius_, 2 * depthProbeRadius_ + 1, 2 * depthProbeRadius_ + 1);
+		DepthStats_ stats = depthIntegral_.isBuilt() ? depthIntegral_.mean(window) : depthStatistics_.compute(depthImage, window, cv::Mat(), false);
+		depth = stats.mean;
+		isValid = stats.count > 0;
+	}
+	else if(isInMM)
 	{
 		depth = (float)depthImage.at<uint16_t>(y,x);
 		isValid = depth != 0.0f;
@@ -823,73 +1692,65 @@ namespace darknet_ros
 	else
 	{
 		// Fill in XYZ
-		pt.val[0] = (float(x) - center_x) * depth * constant_x;
-		pt.val[1] = (float(y) - center_y) * depth * constant_y;
-		pt.val[2] = depth*unit_scaling;
+		pt = backProjection_->point(x, y, depth*unit_scaling);
 	}
 	return pt;
 }
 
    float YoloObjectDetector::getDepth2(const cv::Mat & depthImage, int xmin, int ymin, int xmax, int ymax){
-	float Value = 0, GrayValue=0;	
-	int Ind	= 0;
-	for(int i=xmin; i<=xmax; i++)
-	 for(int j=ymin; j<=ymax; j++)
-	 {
-	    Value=(float)depthImage.at<float>(j,i);
-	    if (Value==Value && (float)depthImage.at<float>(j,i) != 0)
-	    {
-	       GrayValue+=Value; //Sumamos el nivel de gris del pixel  i-esimo
-	       Ind++;
-	    }
-	 }
-
-	return GrayValue=GrayValue/Ind;	
+      // Mean of the valid depth in the window, NaN if there is none.
+      cv::Rect window(cv::Point(xmin, ymin), cv::Point(xmax + 1, ymax + 1));
+      if (depthIntegral_.isBuilt())
+      {
+         return depthIntegral_.mean(window).mean;
+      }
+      return depthStatistics_.compute(depthImage, window, cv::Mat(), false).mean;
    }
 
 
 
    //ros::NodeHandle n;
-   void *YoloObjectDetector::publishInThread()
+   void *YoloObjectDetector::poseInThread(int slot, int camera)
    {
-      // Publish image.
-	static int fl = 0;
-	static struct daKom* WData = (struct daKom*) malloc(sizeof(struct daKom));
-	if (fl==0) { 
-		indivData(); fl=1;
-	}
 	static int tt=0;
         static tf::TransformBroadcaster br;
         static tf::Transform transform;
-      cv::Mat cvImage = cv::cvarrToMat(ipl_);
-      if (!publishDetectionImage(cv::Mat(cvImage)))
-      {
-         ROS_DEBUG("Detection image has not been broadcasted.");
-      }
+      CameraStream_& stream = *cameras_[camera];
+      const CameraView_& view = slots_[slot].views[camera];
 
       // Publish bounding boxes and detection result.
-      int num = roiBoxes_[0].num;
+      const CameraFrame_& frame = view.frame;
+      const cv::Mat& rgb = frame.rgb->image;
+      const cv::Mat depth = frame.depth ? frame.depth->image : cv::Mat();
+      const DetectionBuffer& detections = view.detections;
+      int num = detections.size();
+
+      // Ray tables of this camera, rebuilt only when its intrinsics change.
+      if (stream.backProjection.update(frame.intrinsics))
+      {
+         ROS_INFO("[YoloObjectDetector] %s intrinsics %dx%d fx %.2f fy %.2f cx %.2f cy %.2f.", stream.ns.c_str(), frame.intrinsics.width, frame.intrinsics.height,
+                  frame.intrinsics.fx, frame.intrinsics.fy, frame.intrinsics.cx, frame.intrinsics.cy);
+      }
+      backProjection_ = &stream.backProjection;
+
+      // Every object of this frame goes into one result channel record.
+      ResultFrameRecord record;
+      memset(&record, 0, sizeof(record));
+      record.frameSeq = frame.seq;
+      record.stampNs = frame.header.stamp.toNSec();
+      record.camera = camera;
       if (num > 0 && num <= 100)
       {
-         for (int i = 0; i < num; i++)
-         {
-            for (int j = 0; j < numClasses_; j++)
-            {
-               if (roiBoxes_[i].Class == j)
-               {
-                  rosBoxes_[j].push_back(roiBoxes_[i]);
-                  rosBoxCounter_[j]++;
-               }
-            }
-         }
+         prepareDepthFrame(depth);
 
          std_msgs::Int8 msg;
          msg.data = num;
-         objectPublisher_.publish(msg);
+         stream.objectPublisher.publish(msg);
 
          for (int i = 0; i < numClasses_; i++)
          {
-            if (rosBoxCounter_[i] > 0)
+            // The detections are already bucketed by class.
+            if (detections.classEnd(i) > detections.classBegin(i))
             {
                darknet_ros_msgs::BoundingBox boundingBox;
                darknet_ros_msgs::ObjectPosition objectPosition;
@@ -897,17 +1758,21 @@ namespace darknet_ros
                //tf::TransformBroadcaster br;
                //tf::Transform transform;
 
-               for (int j = 0; j < rosBoxCounter_[i]; j++)
+               for (size_t j = detections.classBegin(i); j < detections.classEnd(i); j++)
                {
-                  int xmin = (rosBoxes_[i][j].x - rosBoxes_[i][j].w / 2) * frameWidth_;
-                  int ymin = (rosBoxes_[i][j].y - rosBoxes_[i][j].h / 2) * frameHeight_;
-                  int xmax = (rosBoxes_[i][j].x + rosBoxes_[i][j].w / 2) * frameWidth_;
-                  int ymax = (rosBoxes_[i][j].y + rosBoxes_[i][j].h / 2) * frameHeight_;
+                  int xmin = (detections.x(j) - detections.w(j) / 2) * rgb.cols;
+                  int ymin = (detections.y(j) - detections.h(j) / 2) * rgb.rows;
+                  int xmax = (detections.x(j) + detections.w(j) / 2) * rgb.cols;
+                  int ymax = (detections.y(j) + detections.h(j) / 2) * rgb.rows;
 
-                  YoloObjectDetector::Coordinates(i, xmin, ymin, xmax, ymax);
+                  Invalid = true;
+                  if (!depth.empty())
+                  {
+                     YoloObjectDetector::Coordinates(rgb, depth, i, xmin, ymin, xmax, ymax);
+                  }
 
                   boundingBox.Class = classLabels_[i];
-                  boundingBox.probability = rosBoxes_[i][j].prob;
+                  boundingBox.probability = detections.prob(j);
                   boundingBox.xmin = xmin;
                   boundingBox.ymin = ymin;
                   boundingBox.xmax = xmax;
@@ -922,6 +1787,29 @@ namespace darknet_ros
                   objectPosition.Y = Y;
                   objectPosition.Z = Z;
                   objectPosition_.object_position_array.push_back(objectPosition);
+
+                  ObjectPoseRecord *pose = 0;
+                  if (record.numObjects < kResultChannelMaxObjects)
+                  {
+                     pose = &record.objects[record.numObjects++];
+                     pose->classId = i;
+                     pose->confidence = detections.prob(j);
+                     pose->flags = Invalid ? 0 : kObjectPositionValid;
+                     pose->orientation[3] = 1;
+                     // X, Y and Z in metres; an invalid position stays zero instead of repeating the previous object's.
+                     if (!Invalid)
+                     {
+                        pose->position[0] = X;
+                        pose->position[1] = Y;
+                        pose->position[2] = Z;
+                     }
+                  }
+
+                  // Without depth there is no position, and no orientation to estimate from it.
+                  if (depth.empty())
+                  {
+                     continue;
+                  }
 			
                   //ros::Rate rate(100.0);
                   //if (nodeHandle_.ok()){
@@ -938,8 +1826,6 @@ namespace darknet_ros
 
 
 			//QTransform>::const_iterator iter=info.objDetected_.constBegin();
-			float cx = 327.8558654785156, cy = 247.04779052734375;
-			float fx = 614.0160522460938, fy = 614.0221557617188;
 			int U = xmax-xmin;
 			int V = ymax-ymin;
 
@@ -959,25 +1845,17 @@ namespace darknet_ros
 			printf("%lf - %lf\n", yAxis_x ,yAxis_y);
 			printf("%d - %d\n", U ,V);
 */
-			ROS_INFO("I heard: [%f][%f][%f]", cv_x, cv_y, theta);
-			cv::Vec3f center3D = this->getDepth(DepthImageCopy_,
-					center_x, center_y,
-					cx, cy,
-					fx, fy);
-
-			cv::Vec3f center3D1 = this->getDepth(DepthImageCopy_,
-					(cv_x*2.0), (cv_y*2.0),					
-					cx, cy,
-					fx, fy);
-
-			cv::Vec3f axisEndX = this->getDepth(DepthImageCopy_,
-					xAxis_x, xAxis_y,
-					cx, cy,
-					fx, fy);
-			cv::Vec3f axisEndY = this->getDepth(DepthImageCopy_,
-					yAxis_x, yAxis_y,
-					cx, cy,
-					fx, fy);
+			ROS_DEBUG("I heard: [%f][%f][%f]", cv_x, cv_y, theta);
+			cv::Vec3f center3D = this->getDepth(depth,
+					center_x, center_y);
+
+			cv::Vec3f center3D1 = this->getDepth(depth,
+					(cv_x*2.0), (cv_y*2.0));
+
+			cv::Vec3f axisEndX = this->getDepth(depth,
+					xAxis_x, xAxis_y);
+			cv::Vec3f axisEndY = this->getDepth(depth,
+					yAxis_x, yAxis_y);
 
 /*			cv::Vec3f center3D;
 			cv::Vec3f axisEndX;
@@ -987,9 +1865,9 @@ namespace darknet_ros
 //			axisEndX.val[2]=(float)DepthImageCopy_.at<float>(xAxis_y,xAxis_x);
 //			axisEndY.val[2]=(float)DepthImageCopy_.at<float>(yAxis_y,yAxis_x);
 
-			center3D.val[2] = this->getDepth2(DepthImageCopy_, center_x-(U/20), center_y-(V/20), center_x+(U/20), center_y+(V/20) );
-			axisEndX.val[2] = this->getDepth2(DepthImageCopy_, xAxis_x-(U/20), xAxis_y-(V/20), xAxis_x+(U/20), xAxis_y+(V/20) );
-			axisEndY.val[2] = this->getDepth2(DepthImageCopy_, yAxis_x-(U/20), yAxis_y-(V/20), yAxis_x+(U/20), yAxis_y+(V/20) );
+			center3D.val[2] = this->getDepth2(depth, center_x-(U/20), center_y-(V/20), center_x+(U/20), center_y+(V/20) );
+			axisEndX.val[2] = this->getDepth2(depth, xAxis_x-(U/20), xAxis_y-(V/20), xAxis_x+(U/20), xAxis_y+(V/20) );
+			axisEndY.val[2] = this->getDepth2(depth, yAxis_x-(U/20), yAxis_y-(V/20), yAxis_x+(U/20), yAxis_y+(V/20) );
 
 //			center3D.val[2] = axisEndX.val[2] = axisEndY.val[2] = Z;
 
@@ -1009,10 +1887,10 @@ namespace darknet_ros
 			transform_.frame_id_ = "camera_link";
 			transform_.stamp_ = ros::Time::now();
 			
-			printf("C %lf ~ %lf ~ %lf\n", center3D.val[0], center3D.val[1] ,center3D.val[2]);
-			printf("C1 %lf ~ %lf ~ %lf\n", center3D1.val[0], center3D1.val[1] ,center3D1.val[2]);
-			printf("%lf ~ %lf ~ %lf\n", axisEndX.val[0], axisEndX.val[1] ,axisEndX.val[2]);
-			printf("%lf ~ %lf ~ %lf\n", axisEndY.val[0], axisEndY.val[1] ,axisEndY.val[2]);
+			ROS_DEBUG("C %lf ~ %lf ~ %lf", center3D.val[0], center3D.val[1] ,center3D.val[2]);
+			ROS_DEBUG("C1 %lf ~ %lf ~ %lf", center3D1.val[0], center3D1.val[1] ,center3D1.val[2]);
+			ROS_DEBUG("%lf ~ %lf ~ %lf", axisEndX.val[0], axisEndX.val[1] ,axisEndX.val[2]);
+			ROS_DEBUG("%lf ~ %lf ~ %lf", axisEndY.val[0], axisEndY.val[1] ,axisEndY.val[2]);
 			
 			//set rotation (y inverted)
 			tf::Vector3 xAxis(axisEndX.val[0] - center3D.val[0], axisEndX.val[1] - center3D.val[1], (axisEndX.val[2] - center3D.val[2])/1000.0);
@@ -1025,41 +1903,44 @@ namespace darknet_ros
 						xAxis.y(), yAxis.y(), zAxis.y(),
 						xAxis.z(), yAxis.z(), zAxis.z());
 			/*			
-			printf("%lf - %lf - %lf\n", xAxis.x(), yAxis.x() ,zAxis.x());
-			printf("%lf - %lf - %lf\n", xAxis.y(), yAxis.y(), zAxis.y());
-			printf("%lf - %lf - %lf\n", xAxis.z(), yAxis.z(), zAxis.z());
+			ROS_DEBUG("%lf - %lf - %lf", xAxis.x(), yAxis.x() ,zAxis.x());
+			ROS_DEBUG("%lf - %lf - %lf", xAxis.y(), yAxis.y(), zAxis.y());
+			ROS_DEBUG("%lf - %lf - %lf", xAxis.z(), yAxis.z(), zAxis.z());
 			*/
 
 			tf::Quaternion q;
 			rotationMatrix.getRotation(q);
 			transform_.setOrigin(tf::Vector3(X,Y,Z));
 			//printf("P : %lf - %lf - %lf\n", center3D.val[0], center3D.val[1], center3D.val[2]);
-			printf("P1 : %lf - %lf - %lf\n", center3D1.val[0], center3D1.val[1], center3D1.val[2]);
+			ROS_DEBUG("P1 : %lf - %lf - %lf", center3D1.val[0], center3D1.val[1], center3D1.val[2]);
 			transform_.setRotation( tf::Quaternion(q) );
-			printf("q : %lf - %lf - %lf - %lf\n", q[0], q[1], q[2], q[3]);
+			ROS_DEBUG("q : %lf - %lf - %lf - %lf", q[0], q[1], q[2], q[3]);
 			transform_.setRotation(q.normalized());
 
-			*resultX = center3D1.val[0]*1000000.0;
-			*resultY = center3D1.val[1]*1000000.0;
-			*resultZ = center3D1.val[2];
-			*resultX1 = center3D.val[0]*1000000.0;
-			*resultY1 = center3D.val[1]*1000000.0;
-			*resultZ1 = center3D.val[2];
-			*resultQX = theta*1000000.0;
-			*resultQY = q[1]*1000000.0;
-			*resultQZ = q[2]*1000000.0;
-
-			*resultQQ = q[3]*1000000.0;
+			// Depth is in mm, the record holds metres.
+			if (pose)
+			{
+				for (int k = 0; k < 3; ++k)
+				{
+					pose->centre[k] = center3D.val[k] * 0.001f;
+					pose->plate[k] = center3D1.val[k] * 0.001f;
+				}
+				pose->plate[3] = theta;
+				for (int k = 0; k < 4; ++k)
+				{
+					pose->orientation[k] = q[k];
+				}
+			}
                }
             }
          }
 
          boundingBoxesResults_.header.stamp = ros::Time::now();
          boundingBoxesResults_.header.frame_id = "detection";
-         boundingBoxesResults_.image_header = imageHeader_;
-         boundingBoxesPublisher_.publish(boundingBoxesResults_);
+         boundingBoxesResults_.image_header = frame.header;
+         stream.boundingBoxesPublisher.publish(boundingBoxesResults_);
 
-         objectPositionPublisher_.publish(objectPosition_);
+         stream.objectPositionPublisher.publish(objectPosition_);
 
       }
       
@@ -1067,119 +1948,175 @@ namespace darknet_ros
       {
          std_msgs::Int8 msg;
          msg.data = 0;
-         objectPublisher_.publish(msg);
+         stream.objectPublisher.publish(msg);
       }
 
-      if (isCheckingForObjects())
+      if (resultChannel_.isOpen())
       {
-         ROS_DEBUG("[YoloObjectDetector] check for objects in image.");
-         darknet_ros_msgs::CheckForObjectsResult objectsActionResult;
-         objectsActionResult.id = buffId_[0];
-         objectsActionResult.bounding_boxes = boundingBoxesResults_;
-         checkForObjectsActionServer_->setSucceeded(objectsActionResult, "Send bounding boxes.");
+         resultChannel_.publish(record);
       }
-
-      boundingBoxesResults_.bounding_boxes.clear();
-      for (int i = 0; i < numClasses_; i++)
+      if (udpPublisher_.isOpen() && !udpPublisher_.send(record, frame.receivedNs))
       {
-         rosBoxes_[i].clear();
-         rosBoxCounter_[i] = 0;
+         ROS_DEBUG("[YoloObjectDetector] UDP result datagram dropped.");
       }
 
+      boundingBoxesResults_.bounding_boxes.clear();
+      objectPosition_.object_position_array.clear();
+
       return 0;
    }
 
-   void YoloObjectDetector::Coordinates(int ObjID, int xmin, int ymin, int xmax, int ymax)
+   void YoloObjectDetector::Coordinates(const cv::Mat& rgbImage, const cv::Mat& depthImage, int ObjID, int xmin, int ymin, int xmax, int ymax)
    {
       //int U = ((xmax-xmin)+xmin);
       //int V = ((ymax-ymin)+ymin);
       int x = ((xmin+xmax)/2);
       int y = ((ymin+ymax)/2);
-      int Ind=0;
-      float GrayValue=0;
-      float Value=0;
       cv::Mat Img; 
       cv::Mat Binaria1;
-      cv::Mat Binaria2;
 
-      cv::cvtColor(camImageCopy_, Img, cv::COLOR_BGR2HSV);
+      // Only the box is converted and thresholded, the depth loop never reads outside it.
+      cv::Rect roi(cv::Point(xmin, ymin), cv::Point(xmax + 1, ymax + 1));
+      roi &= cv::Rect(0, 0, std::min(rgbImage.cols, depthImage.cols), std::min(rgbImage.rows, depthImage.rows));
+      Invalid = true;
+      if (roi.area() == 0)
+      {
+         return;
+      }
+      int group = colourGroup(ObjID);
+      DepthStats_ stats;
+      if (useDepthIntegral_ && depthStatistic_ == DEPTH_MEAN && rgbImage.size() == depthImage.size())
+      {
+         // The mask of the colour is built once per frame, the box then costs four lookups.
+         if (group < 0)
+         {
+            return;
+         }
+         if (!colourIntegrals_[group].isBuilt())
+         {
+            if (hsvFrame_.empty())
+            {
+               cv::cvtColor(rgbImage, hsvFrame_, cv::COLOR_BGR2HSV);
+            }
+            cv::Mat mask;
+            colourMask(hsvFrame_, group, mask);
+            colourIntegrals_[group].build(depthImage, mask);
+         }
+         stats = colourIntegrals_[group].mean(roi);
+      }
+      else
+      {
+         cv::cvtColor(rgbImage(roi), Img, cv::COLOR_BGR2HSV);
+         colourMask(Img, group, Binaria1);
 
+         // Classes without a colour have no mask.
+         if (Binaria1.empty())
+         {
+            return;
+         }
+
+         // Row-major masked summary of the box; no valid sample leaves the position invalid.
+         stats = depthStatistics_.compute(depthImage, roi, Binaria1, depthStatistic_ != DEPTH_MEAN);
+      }
+      float GrayValue = DepthStatistics::select(stats, depthStatistic_);
+      if (stats.count > 0 && GrayValue == GrayValue)
+      {
+         Invalid= false;
+
+         Z=GrayValue/1000;                                                        //Depth in meter
+         //X=(((U-320.5)*Z)/554.254691191187)/1000;                               //X=((U-Cx)*Z)/fx in meter
+         //Y=(((V-240.5)*Z)/554.254691191187)/1000;                               //Y=((V-Cy)*Z)/fy in meter
+         X=backProjection_->rayX(x)*Z-depthOffsetX_;                               //X=((U-Cx)*Z)/fx in meter
+         Y=backProjection_->rayY(y)*Z-depthOffsetY_;                               //Y=((V-Cy)*Z)/fy in meter
+         //Subtraction in X and Y is based on the translation of rosrun tf tf_echo /camera_color_frame /camera_depth_frame
+
+         ROS_DEBUG("X %f, Y %f, Z %f ,Invalido %d", X, Y, Z, Invalid);
+	
+      }
+   }
+
+   int YoloObjectDetector::colourGroup(int ObjID)
+   {
       if (ObjID==0 || ObjID==3 || ObjID==6 || ObjID==9)  //Rojo
+         return 0;
+      if (ObjID==1 || ObjID==4 || ObjID==7 || ObjID==10)  //Azul
+         return 1;
+      if (ObjID==2 || ObjID==5 || ObjID==8 || ObjID==11)  //Verde
+         return 2;
+      if (ObjID==12)  //Amarillo
+         return 3;
+      if (ObjID==13)  //Bomba
+         return 4;
+      return -1;
+   }
+
+   void YoloObjectDetector::colourMask(const cv::Mat& hsv, int group, cv::Mat& mask)
+   {
+      mask.release();
+      if (group == 0)  //Rojo
       {
          cv::Scalar RojosBajos1(0,65,75);
          cv::Scalar RojosAltos1(12,255,255);
          cv::Scalar RojosBajos2(240,65,75);
          cv::Scalar RojosAltos2(256,255,255);
 
-         cv::inRange(Img, RojosBajos1, RojosAltos1, Binaria1);
-         cv::inRange(Img, RojosBajos2, RojosAltos2, Binaria2);
-         cv::add(Binaria1,Binaria2,Binaria1);
-		   //cv::imshow("Rojo",Binaria1);
+         cv::Mat mask2;
+         cv::inRange(hsv, RojosBajos1, RojosAltos1, mask);
+         cv::inRange(hsv, RojosBajos2, RojosAltos2, mask2);
+         cv::add(mask,mask2,mask);
+		   //cv::imshow("Rojo",mask);
       }
 
-      else if (ObjID==1 || ObjID==4 || ObjID==7 || ObjID==10)  //Azul
+      else if (group == 1)  //Azul
       {
          cv::Scalar AzulesBajos(100,65,75);
          cv::Scalar AzulesAltos(130,255,255);
 
-         cv::inRange(Img, AzulesBajos, AzulesAltos, Binaria1);
-         //cv::imshow("Azul",Binaria1);
+         cv::inRange(hsv, AzulesBajos, AzulesAltos, mask);
+         //cv::imshow("Azul",mask);
       }
 
-      else if (ObjID==2 || ObjID==5 || ObjID==8 || ObjID==11)  //Verde
+      else if (group == 2)  //Verde
       {
          cv::Scalar VerdesBajos(49,50,50);
          cv::Scalar VerdesAltos(107,255,255);
 
-         cv::inRange(Img, VerdesBajos, VerdesAltos, Binaria1);
-         //cv::imshow("Verde",Binaria1);
+         cv::inRange(hsv, VerdesBajos, VerdesAltos, mask);
+         //cv::imshow("Verde",mask);
       }
 
-      else if (ObjID==12)  //Amarillo
+      else if (group == 3)  //Amarillo
       {
          cv::Scalar AmarillosBajos(20,100,100);
          cv::Scalar AmarillosAltos(30,255,255);
 
-         cv::inRange(Img, AmarillosBajos, AmarillosAltos, Binaria1);
-         //cv::imshow("Amarillo",Binaria1);
+         cv::inRange(hsv, AmarillosBajos, AmarillosAltos, mask);
+         //cv::imshow("Amarillo",mask);
       }
 
-      else if (ObjID==13)  //Bomba
+      else if (group == 4)  //Bomba
       {      
          cv::Scalar NegrosBajos(0,0,0);   
          cv::Scalar NegrosAltos(0,0,10);
  
-         cv::inRange(Img, NegrosBajos, NegrosAltos, Binaria1);
-         //cv::imshow("Negro",Binaria1);
+         cv::inRange(hsv, NegrosBajos, NegrosAltos, mask);
+         //cv::imshow("Negro",mask);
       }
-	
-	  for(int i=xmin; i<=xmax; i++)
-         for(int j=ymin; j<=ymax; j++)
-         {
-            Value=(float)DepthImageCopy_.at<float>(j,i);
-            if (Value==Value && ((int)Binaria1.at<uchar>(j,i))!=0)
-            {
-               GrayValue+=Value; //Sumamos el nivel de gris del pixel  i-esimo
-               Ind++;
-            }
-         }
-
-	  GrayValue=GrayValue/Ind;
+   }
 
-	  Invalid= true;
-	  if (GrayValue!=0)
+   void YoloObjectDetector::prepareDepthFrame(const cv::Mat& depthImage)
+   {
+      hsvFrame_.release();
+      for (int g = 0; g < numColourGroups_; ++g)
       {
-         Invalid= false;
-
-         Z=GrayValue/1000;                                                        //Depth in meter
-         //X=(((U-320.5)*Z)/554.254691191187)/1000;                               //X=((U-Cx)*Z)/fx in meter
-         //Y=(((V-240.5)*Z)/554.254691191187)/1000;                               //Y=((V-Cy)*Z)/fy in meter
-         X=((((float(x)-327.8558654785156)*Z)/614.0160522460938)-(1000*(-0.001)))/1000;  //X=((U-Cx)*Z)/fx in meter
-         Y=((((float(y)-247.04779052734375)*Z)/614.0221557617188)-(1000*0.015))/1000;    //Y=((V-Cy)*Z)/fy in meter
-         //Subtraction in X and Y is based on the translation of rosrun tf tf_echo /camera_color_frame /camera_depth_frame
+         colourIntegrals_[g].clear();
+      }
+      depthIntegral_.clear();
 
-         ROS_INFO("X %f, Y %f, Z %f ,Invalido %d", X, Y, Z, Invalid);
-	
+      // The unmasked table only serves the point probes.
+      if (useDepthIntegral_ && depthProbeRadius_ > 0 && !depthImage.empty())
+      {
+         depthIntegral_.build(depthImage, cv::Mat());
       }
    }
 }
@@ -8,11 +8,13 @@
 
 #include "darknet_ros/image_interface.h"
 
-static float get_pixel(image m, int x, int y, int c)
-{
-    assert(x < m.w && y < m.h && c < m.c);
-    return m.data[c*m.h*m.w + y*m.w + x];
-}
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 
 image **load_alphabet_with_file(char *datafile) {
   int i, j;
@@ -33,20 +35,159 @@ image **load_alphabet_with_file(char *datafile) {
   return alphabets;
 }
 
-#ifdef OPENCV
-void generate_image(image p, IplImage *disp)
+// dst[i] = a*row0[i] + b*row1[i] for n interleaved bytes, the vertical half of the bilinear resize.
+static void blend_rows_u8(const unsigned char *row0, const unsigned char *row1, float a, float b, float *dst, int n)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    __m256 va = _mm256_set1_ps(a);
+    __m256 vb = _mm256_set1_ps(b);
+    for(; i + 8 <= n; i += 8){
+        __m256 p0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(row0 + i))));
+        __m256 p1 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(row1 + i))));
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_mul_ps(va, p0), _mm256_mul_ps(vb, p1)));
+    }
+#elif defined(__SSE2__)
+    __m128 va = _mm_set1_ps(a);
+    __m128 vb = _mm_set1_ps(b);
+    __m128i zero = _mm_setzero_si128();
+    for(; i + 8 <= n; i += 8){
+        __m128i p0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(row0 + i)), zero);
+        __m128i p1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(row1 + i)), zero);
+        __m128 p0lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(p0, zero));
+        __m128 p0hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(p0, zero));
+        __m128 p1lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(p1, zero));
+        __m128 p1hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(p1, zero));
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_mul_ps(va, p0lo), _mm_mul_ps(vb, p1lo)));
+        _mm_storeu_ps(dst + i + 4, _mm_add_ps(_mm_mul_ps(va, p0hi), _mm_mul_ps(vb, p1hi)));
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for(; i + 8 <= n; i += 8){
+        uint16x8_t p0 = vmovl_u8(vld1_u8(row0 + i));
+        uint16x8_t p1 = vmovl_u8(vld1_u8(row1 + i));
+        float32x4_t lo = vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(p0))), a);
+        float32x4_t hi = vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(p0))), a);
+        lo = vmlaq_n_f32(lo, vcvtq_f32_u32(vmovl_u16(vget_low_u16(p1))), b);
+        hi = vmlaq_n_f32(hi, vcvtq_f32_u32(vmovl_u16(vget_high_u16(p1))), b);
+        vst1q_f32(dst + i, lo);
+        vst1q_f32(dst + i + 4, hi);
+    }
+#endif
+    for(; i < n; ++i){
+        dst[i] = a*row0[i] + b*row1[i];
+    }
+}
+
+letterbox_scratch make_letterbox_scratch(void)
+{
+    letterbox_scratch s = {0, 0, 0, 0, 0};
+    return s;
+}
+
+void free_letterbox_scratch(letterbox_scratch *s)
+{
+    free(s->x0);
+    free(s->fx);
+    free(s->row);
+    *s = make_letterbox_scratch();
+}
+
+// Sizes the scratch for a w pixel wide source resized to new_w, the taps are only recomputed when either changes.
+static int prepare_letterbox_scratch(letterbox_scratch *s, int w, int new_w)
 {
-    int x,y,k;
-    if(p.c == 3) rgbgr_image(p);
-    //normalize_image(copy);
-
-    int step = disp->widthStep;
-    for(y = 0; y < p.h; ++y){
-        for(x = 0; x < p.w; ++x){
-            for(k= 0; k < p.c; ++k){
-                disp->imageData[y*step + x*p.c + k] = (unsigned char)(get_pixel(p,x,y,k)*255);
+    int x;
+    if(s->w == w && s->new_w == new_w) return 1;
+    int *x0 = realloc(s->x0, new_w*sizeof(int));
+    if(x0) s->x0 = x0;
+    float *fx = realloc(s->fx, new_w*sizeof(float));
+    if(fx) s->fx = fx;
+    float *row = realloc(s->row, w*3*sizeof(float));
+    if(row) s->row = row;
+    if(!x0 || !fx || !row){
+        s->w = s->new_w = 0;
+        return 0;
+    }
+    // Horizontal taps, same corner-aligned sampling as resize_image.
+    float w_scale = (float)(w - 1) / (new_w - 1);
+    for(x = 0; x < new_w; ++x){
+        if(x == new_w-1 || w == 1){
+            x0[x] = w - 1;
+            fx[x] = 0;
+        } else {
+            float sx = x*w_scale;
+            x0[x] = (int) sx;
+            fx[x] = sx - x0[x];
+        }
+    }
+    s->w = w;
+    s->new_w = new_w;
+    return 1;
+}
+
+int bgr8_letterbox_into(const unsigned char *src, int w, int h, int step, image boxed, letterbox_scratch *scratch)
+{
+    int x, y, k;
+    int new_w = boxed.w;
+    int new_h = boxed.h;
+    if (((float)boxed.w/w) < ((float)boxed.h/h)) {
+        new_h = (h * boxed.w)/w;
+    } else {
+        new_w = (w * boxed.h)/h;
+    }
+    int dx = (boxed.w - new_w)/2;
+    int dy = (boxed.h - new_h)/2;
+    int plane = boxed.w*boxed.h;
+    assert(boxed.c == 3);
+
+    // Padding, identical to fill_image(boxed, .5) outside the embedded area.
+    for(k = 0; k < 3; ++k){
+        float *p = boxed.data + k*plane;
+        for(y = 0; y < boxed.h; ++y){
+            float *r = p + y*boxed.w;
+            if(y < dy || y >= dy + new_h){
+                for(x = 0; x < boxed.w; ++x) r[x] = .5;
+            } else {
+                for(x = 0; x < dx; ++x) r[x] = .5;
+                for(x = dx + new_w; x < boxed.w; ++x) r[x] = .5;
             }
         }
     }
+
+    // Without scratch the embedded area becomes padding too, the network sees a blank frame.
+    if(!prepare_letterbox_scratch(scratch, w, new_w)){
+        for(k = 0; k < 3*plane; ++k) boxed.data[k] = .5;
+        return 0;
+    }
+    const int *x0 = scratch->x0;
+    const float *fx = scratch->fx;
+    float *row = scratch->row;
+    float h_scale = (float)(h - 1) / (new_h - 1);
+
+    for(y = 0; y < new_h; ++y){
+        float sy = y*h_scale;
+        int iy = (int) sy;
+        float fy = sy - iy;
+        // The last row samples the last source row exactly, resize_image can round it down to iy = h-2.
+        if(y == new_h-1 || h == 1 || iy + 1 >= h){
+            iy = (y == new_h-1) ? h - 1 : iy;
+            fy = 0;
+        }
+        const unsigned char *row0 = src + iy*step;
+        const unsigned char *row1 = fy > 0 ? row0 + step : row0;
+        blend_rows_u8(row0, row1, (1 - fy)/255.f, fy/255.f, row, w*3);
+
+        float *r = boxed.data + (y + dy)*boxed.w + dx;
+        float *g = r + plane;
+        float *b = g + plane;
+        for(x = 0; x < new_w; ++x){
+            const float *p0 = row + 3*x0[x];
+            const float *p1 = (x0[x] + 1 < w) ? p0 + 3 : p0;
+            float a1 = fx[x];
+            float a0 = 1 - a1;
+            b[x] = a0*p0[0] + a1*p1[0];
+            g[x] = a0*p0[1] + a1*p1[1];
+            r[x] = a0*p0[2] + a1*p1[2];
+        }
+    }
+    return 1;
 }
-#endif
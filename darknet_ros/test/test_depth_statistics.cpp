@@ -0,0 +1,257 @@
+/*
+ * test_depth_statistics.cpp
+ *
+ *  DepthStatistics and DepthIntegral against brute-force summaries of the
+ *  masked box, the box-local HSV mask against the full-frame one, and the
+ *  per-frame cost of the three ways Coordinates can mask a box against the
+ *  number of boxes.
+ */
+
+   // c++
+   #include <algorithm>
+   #include <chrono>
+   #include <cmath>
+   #include <cstdio>
+   #include <limits>
+   #include <vector>
+
+   // OpenCv
+   #include <opencv2/core/core.hpp>
+   #include <opencv2/imgproc/imgproc.hpp>
+
+   // gtest
+   #include <gtest/gtest.h>
+
+#include "darknet_ros/DepthStatistics.hpp"
+
+using namespace darknet_ros;
+
+namespace
+{
+   // The blue range of YoloObjectDetector::colourMask.
+   const cv::Scalar kHsvLow(100, 65, 75);
+   const cv::Scalar kHsvHigh(130, 255, 255);
+
+   // Depth in millimetres with holes: 0 in both types, NaN and infinity in 32FC1.
+   cv::Mat randomDepth(int type, cv::Size size, unsigned seed)
+   {
+      cv::Mat depth(size, type);
+      cv::RNG rng(seed);
+      rng.fill(depth, cv::RNG::UNIFORM, 300, 5000);
+      for (int i = 0; i < size.area() / 10; ++i)
+      {
+         int x = rng.uniform(0, size.width), y = rng.uniform(0, size.height);
+         if (type == CV_16UC1)
+            depth.at<uint16_t>(y, x) = 0;
+         else
+         {
+            const float holes[] = {0.f, -1.f, std::numeric_limits<float>::quiet_NaN(), std::numeric_limits<float>::infinity()};
+            depth.at<float>(y, x) = holes[i % 4];
+         }
+      }
+      return depth;
+   }
+
+   cv::Mat randomMask(cv::Size size, unsigned seed)
+   {
+      cv::Mat mask(size, CV_8UC1);
+      cv::RNG rng(seed);
+      rng.fill(mask, cv::RNG::UNIFORM, 0, 2);
+      return mask * 255;
+   }
+
+   // Valid masked samples of the box in row-major order.
+   std::vector<float> samples(const cv::Mat& depth, cv::Rect roi, const cv::Mat& mask)
+   {
+      std::vector<float> v;
+      for (int y = 0; y < roi.height; ++y)
+      {
+         for (int x = 0; x < roi.width; ++x)
+         {
+            if (!mask.empty() && !mask.at<uchar>(y, x))
+               continue;
+            float d = depth.type() == CV_16UC1 ? depth.at<uint16_t>(roi.y + y, roi.x + x) : depth.at<float>(roi.y + y, roi.x + x);
+            if (d > 0 && d < std::numeric_limits<float>::infinity())
+               v.push_back(d);
+         }
+      }
+      return v;
+   }
+
+   void expectRelativeNear(double expected, double actual, double tolerance, const char *what)
+   {
+      EXPECT_NEAR(expected, actual, tolerance * std::max(1., std::fabs(expected))) << what;
+   }
+
+   std::vector<cv::Rect> randomBoxes(int n, cv::Size frame, unsigned seed)
+   {
+      std::vector<cv::Rect> boxes;
+      cv::RNG rng(seed);
+      for (int i = 0; i < n; ++i)
+      {
+         int w = rng.uniform(1, frame.width / 4), h = rng.uniform(1, frame.height / 4);
+         boxes.push_back(cv::Rect(rng.uniform(0, frame.width - w), rng.uniform(0, frame.height - h), w, h));
+      }
+      return boxes;
+   }
+}
+
+TEST(DepthStatistics, MatchesBruteForceOnMaskedBoxes)
+{
+   const float kPercentile = .2f, kTrim = .1f;
+   DepthStatistics statistics(kPercentile, kTrim);
+   for (int type : {CV_32FC1, CV_16UC1})
+   {
+      cv::Mat depth = randomDepth(type, cv::Size(640, 480), type + 1);
+      std::vector<cv::Rect> boxes = randomBoxes(50, depth.size(), type + 2);
+      for (size_t b = 0; b < boxes.size(); ++b)
+      {
+         const cv::Rect& roi = boxes[b];
+         // Every other box unmasked, the masked ones with a box-sized mask as Coordinates passes it.
+         cv::Mat mask = b % 2 ? cv::Mat() : randomMask(roi.size(), b);
+         std::vector<float> v = samples(depth, roi, mask);
+         DepthStats_ stats = statistics.compute(depth, roi, mask, true);
+         ASSERT_EQ((int) v.size(), stats.count) << "box " << b;
+         if (v.empty())
+            continue;
+
+         double sum = 0;
+         for (size_t i = 0; i < v.size(); ++i)
+            sum += v[i];
+         std::sort(v.begin(), v.end());
+         size_t n = v.size();
+         size_t p = std::min(n - 1, (size_t) (kPercentile * (n - 1) + 0.5f));
+         size_t lo = kTrim * n, hi = n - lo;
+         double trimmed = 0;
+         for (size_t i = lo; i < hi; ++i)
+            trimmed += v[i];
+
+         expectRelativeNear(sum / n, stats.mean, 1e-5, "mean");
+         EXPECT_EQ(v[n / 2], stats.median);
+         EXPECT_EQ(v[p], stats.percentile);
+         expectRelativeNear(trimmed / (hi - lo), stats.trimmedMean, 1e-5, "trimmed mean");
+
+         // The mean-only scan takes the SIMD path and must agree with the gathering one.
+         DepthStats_ fast = statistics.compute(depth, roi, mask, false);
+         EXPECT_EQ(stats.count, fast.count);
+         expectRelativeNear(sum / n, fast.mean, 1e-5, "mean only");
+      }
+   }
+}
+
+TEST(DepthStatistics, BoxWithoutValidDepthIsInvalid)
+{
+   DepthStatistics statistics;
+   cv::Mat depth(10, 10, CV_32FC1, cv::Scalar(std::numeric_limits<float>::quiet_NaN()));
+   DepthStats_ stats = statistics.compute(depth, cv::Rect(2, 2, 5, 5), cv::Mat(), true);
+   EXPECT_EQ(0, stats.count);
+   EXPECT_NE(stats.mean, stats.mean);
+   EXPECT_EQ(0, statistics.compute(depth, cv::Rect(20, 20, 5, 5), cv::Mat(), false).count);
+}
+
+TEST(DepthIntegral, MeanMatchesCompute)
+{
+   DepthStatistics statistics;
+   for (int type : {CV_32FC1, CV_16UC1})
+   {
+      cv::Mat depth = randomDepth(type, cv::Size(640, 480), type + 3);
+      cv::Mat mask = randomMask(depth.size(), type + 4);
+      DepthIntegral integral;
+      ASSERT_TRUE(integral.build(depth, mask));
+      std::vector<cv::Rect> boxes = randomBoxes(100, depth.size(), type + 5);
+      // Boxes reaching outside the frame are clipped the same way by both.
+      boxes.push_back(cv::Rect(600, 440, 100, 100));
+      for (size_t b = 0; b < boxes.size(); ++b)
+      {
+         cv::Rect clipped = boxes[b] & cv::Rect(0, 0, depth.cols, depth.rows);
+         DepthStats_ expected = statistics.compute(depth, clipped, mask(clipped), false);
+         DepthStats_ actual = integral.mean(boxes[b]);
+         ASSERT_EQ(expected.count, actual.count) << "box " << b;
+         if (expected.count > 0)
+            expectRelativeNear(expected.mean, actual.mean, 1e-5, "integral mean");
+      }
+   }
+}
+
+TEST(ColourMask, BoxLocalMaskEqualsCroppedFrameMask)
+{
+   cv::Mat bgr(480, 640, CV_8UC3);
+   cv::randu(bgr, cv::Scalar::all(0), cv::Scalar::all(256));
+   cv::Mat hsv, frameMask;
+   cv::cvtColor(bgr, hsv, cv::COLOR_BGR2HSV);
+   cv::inRange(hsv, kHsvLow, kHsvHigh, frameMask);
+   ASSERT_GT(cv::countNonZero(frameMask), 0);
+
+   std::vector<cv::Rect> boxes = randomBoxes(50, bgr.size(), 9);
+   for (size_t b = 0; b < boxes.size(); ++b)
+   {
+      cv::Mat boxHsv, boxMask;
+      cv::cvtColor(bgr(boxes[b]), boxHsv, cv::COLOR_BGR2HSV);
+      cv::inRange(boxHsv, kHsvLow, kHsvHigh, boxMask);
+      EXPECT_EQ(0, cv::countNonZero(boxMask != frameMask(boxes[b]))) << "box " << b;
+   }
+}
+
+// Per-frame cost of the depth of every box: the old full-frame conversion per box, the box-local
+// conversion Coordinates does now, and the depth/use_integral_image tables built once per frame.
+TEST(ColourMask, TimingAgainstBoxCount)
+{
+   const cv::Size kFrame(1280, 720);
+   cv::Mat bgr(kFrame, CV_8UC3);
+   cv::randu(bgr, cv::Scalar::all(0), cv::Scalar::all(256));
+   cv::Mat depth = randomDepth(CV_16UC1, kFrame, 11);
+   DepthStatistics statistics;
+   DepthIntegral integral;
+   const int kRepeats = 10;
+
+   for (int n : {1, 5, 10, 20})
+   {
+      std::vector<cv::Rect> boxes = randomBoxes(n, kFrame, n);
+      cv::Mat hsv, mask;
+      double sink = 0;
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for (int r = 0; r < kRepeats; ++r)
+      {
+         for (size_t b = 0; b < boxes.size(); ++b)
+         {
+            cv::cvtColor(bgr, hsv, cv::COLOR_BGR2HSV);
+            cv::inRange(hsv, kHsvLow, kHsvHigh, mask);
+            sink += statistics.compute(depth, boxes[b], mask(boxes[b]), false).count;
+         }
+      }
+      double frame = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / kRepeats;
+
+      start = std::chrono::steady_clock::now();
+      for (int r = 0; r < kRepeats; ++r)
+      {
+         for (size_t b = 0; b < boxes.size(); ++b)
+         {
+            cv::cvtColor(bgr(boxes[b]), hsv, cv::COLOR_BGR2HSV);
+            cv::inRange(hsv, kHsvLow, kHsvHigh, mask);
+            sink += statistics.compute(depth, boxes[b], mask, false).count;
+         }
+      }
+      double box = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / kRepeats;
+
+      start = std::chrono::steady_clock::now();
+      for (int r = 0; r < kRepeats; ++r)
+      {
+         cv::cvtColor(bgr, hsv, cv::COLOR_BGR2HSV);
+         cv::inRange(hsv, kHsvLow, kHsvHigh, mask);
+         integral.build(depth, mask);
+         for (size_t b = 0; b < boxes.size(); ++b)
+            sink += integral.mean(boxes[b]).count;
+      }
+      double tables = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / kRepeats;
+
+      EXPECT_GT(sink, 0);
+      printf("%2d boxes: full frame per box %.3f ms, box-local %.3f ms, integral tables %.3f ms per frame\n", n, frame, box, tables);
+   }
+}
+
+int main(int argc, char **argv)
+{
+   testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
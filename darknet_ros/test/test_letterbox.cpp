@@ -0,0 +1,188 @@
+/*
+ * test_letterbox.cpp
+ *
+ *  Equivalence of bgr8_letterbox_into with the darknet path it replaces:
+ *  ipl_into_image, rgbgr_image and letterbox_image_into on a padded input.
+ *  Also times both paths on the usual camera resolutions.
+ */
+
+   // c++
+   #include <algorithm>
+   #include <chrono>
+   #include <cmath>
+   #include <cstdio>
+   #include <cstdlib>
+   #include <cstring>
+   #include <functional>
+   #include <vector>
+
+   // gtest
+   #include <gtest/gtest.h>
+
+extern "C"
+{
+   #include "image.h"
+   #include "darknet_ros/image_interface.h"
+}
+
+namespace
+{
+   // Per-channel difference allowed: darknet resizes horizontally first on floats divided by 255,
+   // bgr8_letterbox_into blends the source rows first with the 1/255 folded into the weights.
+   const float kTolerance = 1e-5f;
+
+   struct Size
+   {
+      int w;
+      int h;
+   };
+
+   std::vector<unsigned char> randomFrame(int w, int h, int step, unsigned seed)
+   {
+      std::vector<unsigned char> frame(step * h);
+      srand(seed);
+      for (size_t i = 0; i < frame.size(); ++i)
+         frame[i] = rand() % 256;
+      return frame;
+   }
+
+   // The replaced path: ipl_into_image, rgbgr_image and letterbox_image_into into a padded input.
+   void darknetLetterbox(const unsigned char *src, int w, int h, int step, image boxed)
+   {
+      image im = make_image(w, h, 3);
+      for (int y = 0; y < h; ++y)
+         for (int x = 0; x < w; ++x)
+            for (int k = 0; k < 3; ++k)
+               im.data[k*w*h + y*w + x] = src[y*step + x*3 + k]/255.;
+      rgbgr_image(im);
+      fill_image(boxed, .5);
+      letterbox_image_into(im, boxed.w, boxed.h, boxed);
+      free_image(im);
+   }
+
+   // Embedded area of the letterbox, as computed by letterbox_image_into.
+   void embedded(int w, int h, image boxed, int& newW, int& newH, int& dx, int& dy)
+   {
+      newW = boxed.w;
+      newH = boxed.h;
+      if (((float) boxed.w/w) < ((float) boxed.h/h))
+         newH = (h*boxed.w)/w;
+      else
+         newW = (w*boxed.h)/h;
+      dx = (boxed.w - newW)/2;
+      dy = (boxed.h - newH)/2;
+   }
+
+   double millisecondsPerCall(int repeats, const std::function<void()>& call)
+   {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for (int r = 0; r < repeats; ++r)
+         call();
+      return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()/repeats;
+   }
+}
+
+TEST(Letterbox, MatchesDarknetLetterbox)
+{
+   const Size kFrames[] = {{640, 480}, {1280, 720}, {1920, 1080}, {480, 640}, {416, 416}, {37, 5}, {3, 200}};
+   const Size kNetworks[] = {{416, 416}, {608, 352}};
+   // One scratch for every size, the way a camera stream keeps it.
+   letterbox_scratch scratch = make_letterbox_scratch();
+
+   for (const Size& network : kNetworks)
+   {
+      image fused = make_image(network.w, network.h, 3);
+      image reference = make_image(network.w, network.h, 3);
+      for (const Size& frame : kFrames)
+      {
+         const int step = frame.w*3 + 5;   // Row padding, like a cv::Mat ROI.
+         std::vector<unsigned char> src = randomFrame(frame.w, frame.h, step, frame.w*frame.h);
+         ASSERT_TRUE(bgr8_letterbox_into(&src[0], frame.w, frame.h, step, fused, &scratch));
+         darknetLetterbox(&src[0], frame.w, frame.h, step, reference);
+
+         int newW, newH, dx, dy;
+         embedded(frame.w, frame.h, fused, newW, newH, dx, dy);
+         int mismatches = 0;
+         float worst = 0;
+         for (int k = 0; k < 3; ++k)
+         {
+            for (int y = 0; y < fused.h; ++y)
+            {
+               // resize_image samples the last embedded row with weights that need not sum to one,
+               // bgr8_letterbox_into takes the last source row there; it is checked below instead.
+               if (y == dy + newH - 1)
+                  continue;
+               for (int x = 0; x < fused.w; ++x)
+               {
+                  int i = k*fused.w*fused.h + y*fused.w + x;
+                  float difference = std::fabs(fused.data[i] - reference.data[i]);
+                  worst = std::max(worst, difference);
+                  if (difference > kTolerance)
+                     ++mismatches;
+               }
+            }
+         }
+         EXPECT_EQ(0, mismatches) << frame.w << "x" << frame.h << " into " << network.w << "x" << network.h << ", worst " << worst;
+
+         // The last embedded row is the last source row resized horizontally.
+         image im = make_image(frame.w, frame.h, 3);
+         for (int y = 0; y < frame.h; ++y)
+            for (int x = 0; x < frame.w; ++x)
+               for (int k = 0; k < 3; ++k)
+                  im.data[k*frame.w*frame.h + y*frame.w + x] = src[y*step + x*3 + k]/255.;
+         rgbgr_image(im);
+         image row = resize_image(im, newW, frame.h);
+         for (int k = 0; k < 3; ++k)
+            for (int x = 0; x < newW; ++x)
+               ASSERT_NEAR(row.data[k*newW*frame.h + (frame.h - 1)*newW + x], fused.data[k*fused.w*fused.h + (dy + newH - 1)*fused.w + dx + x], kTolerance)
+                  << frame.w << "x" << frame.h << " channel " << k << " column " << x;
+         free_image(row);
+         free_image(im);
+      }
+      free_image(reference);
+      free_image(fused);
+   }
+   free_letterbox_scratch(&scratch);
+}
+
+TEST(Letterbox, ReusedScratchGivesTheSameInput)
+{
+   const Size kFrames[] = {{640, 480}, {37, 5}, {1280, 720}, {640, 480}};
+   letterbox_scratch reused = make_letterbox_scratch();
+   image a = make_image(416, 416, 3);
+   image b = make_image(416, 416, 3);
+   for (const Size& frame : kFrames)
+   {
+      std::vector<unsigned char> src = randomFrame(frame.w, frame.h, frame.w*3, frame.h);
+      ASSERT_TRUE(bgr8_letterbox_into(&src[0], frame.w, frame.h, frame.w*3, a, &reused));
+      letterbox_scratch fresh = make_letterbox_scratch();
+      ASSERT_TRUE(bgr8_letterbox_into(&src[0], frame.w, frame.h, frame.w*3, b, &fresh));
+      free_letterbox_scratch(&fresh);
+      EXPECT_EQ(0, memcmp(a.data, b.data, 416*416*3*sizeof(float))) << frame.w << "x" << frame.h;
+   }
+   free_image(b);
+   free_image(a);
+   free_letterbox_scratch(&reused);
+}
+
+TEST(Letterbox, Timing)
+{
+   const Size kFrames[] = {{640, 480}, {1280, 720}, {1920, 1080}};
+   letterbox_scratch scratch = make_letterbox_scratch();
+   image boxed = make_image(416, 416, 3);
+   for (const Size& frame : kFrames)
+   {
+      std::vector<unsigned char> src = randomFrame(frame.w, frame.h, frame.w*3, 1);
+      double darknet = millisecondsPerCall(10, [&] { darknetLetterbox(&src[0], frame.w, frame.h, frame.w*3, boxed); });
+      double fused = millisecondsPerCall(50, [&] { bgr8_letterbox_into(&src[0], frame.w, frame.h, frame.w*3, boxed, &scratch); });
+      printf("%dx%d into 416x416: darknet path %.3f ms, bgr8_letterbox_into %.3f ms\n", frame.w, frame.h, darknet, fused);
+   }
+   free_image(boxed);
+   free_letterbox_scratch(&scratch);
+}
+
+int main(int argc, char **argv)
+{
+   testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
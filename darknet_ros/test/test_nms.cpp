@@ -0,0 +1,238 @@
+/*
+ * test_nms.cpp
+ *
+ *  Equivalence of NmsEngine with the darknet reference functions: NMS_CLASS
+ *  against do_nms_sort, NMS_DARKNET against do_nms_obj, the agnostic and
+ *  soft modes against straightforward quadratic versions. Also times the
+ *  engine against do_nms_obj at 100, 1k and 10k candidates.
+ */
+
+   // c++
+   #include <algorithm>
+   #include <chrono>
+   #include <cmath>
+   #include <cstdio>
+   #include <cstdlib>
+   #include <vector>
+
+   // gtest
+   #include <gtest/gtest.h>
+
+#include "darknet_ros/NmsEngine.hpp"
+
+using namespace darknet_ros;
+
+namespace
+{
+   const int kClasses = 5;
+   const float kIou = .4f;
+   const float kScoreThreshold = .25f;
+
+   // Candidate boxes with their own probabilities, copied with the prob pointers moved along.
+   struct Candidates
+   {
+      std::vector<detection> dets;
+      std::vector<float> probs;
+
+      Candidates() {}
+
+      Candidates(const Candidates& other) : dets(other.dets), probs(other.probs)
+      {
+         for (size_t i = 0; i < dets.size(); ++i)
+            dets[i].prob = &probs[i * kClasses];
+      }
+   };
+
+   // Boxes in relative coordinates, each class score either 0 or above kScoreThreshold, so darknet and the
+   // engine see the same candidates; random scores make ties, which the two may break differently, unlikely.
+   Candidates generate(int n, unsigned seed)
+   {
+      Candidates c;
+      c.dets.resize(n);
+      c.probs.assign(n * kClasses, 0.f);
+      srand(seed);
+      for (int i = 0; i < n; ++i)
+      {
+         detection& det = c.dets[i];
+         det.bbox.x = rand() / (float) RAND_MAX;
+         det.bbox.y = rand() / (float) RAND_MAX;
+         det.bbox.w = .02f + .1f * rand() / RAND_MAX;
+         det.bbox.h = .02f + .1f * rand() / RAND_MAX;
+         det.classes = kClasses;
+         det.prob = &c.probs[i * kClasses];
+         det.mask = 0;
+         det.objectness = .01f + .99f * rand() / RAND_MAX;
+         det.sort_class = 0;
+         for (int k = 0; k < kClasses; ++k)
+            if (rand() % 3 == 0)
+               det.prob[k] = kScoreThreshold + .01f + (1 - kScoreThreshold - .01f) * rand() / RAND_MAX;
+      }
+      return c;
+   }
+
+   int differences(const std::vector<float>& a, const std::vector<float>& b, float tolerance)
+   {
+      int n = 0;
+      for (size_t i = 0; i < a.size(); ++i)
+         if (std::fabs(a[i] - b[i]) > tolerance * std::max(1.f, std::fabs(b[i])))
+            ++n;
+      return n;
+   }
+
+   int survivors(const std::vector<float>& probs)
+   {
+      return std::count_if(probs.begin(), probs.end(), [](float p) { return p > kScoreThreshold; });
+   }
+
+   // Greedy NMS across classes by the best class score, a suppressed box loses every class.
+   void agnosticReference(Candidates& c)
+   {
+      std::vector<int> order;
+      std::vector<float> best(c.dets.size(), 0.f);
+      for (size_t i = 0; i < c.dets.size(); ++i)
+      {
+         best[i] = *std::max_element(c.dets[i].prob, c.dets[i].prob + kClasses);
+         if (best[i] > kScoreThreshold)
+            order.push_back(i);
+      }
+      std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return best[a] > best[b]; });
+      std::vector<int> kept;
+      for (size_t k = 0; k < order.size(); ++k)
+      {
+         detection& det = c.dets[order[k]];
+         bool suppressed = false;
+         for (size_t j = 0; j < kept.size() && !suppressed; ++j)
+            suppressed = box_iou(det.bbox, c.dets[kept[j]].bbox) > kIou;
+         if (suppressed)
+            std::fill(det.prob, det.prob + kClasses, 0.f);
+         else
+            kept.push_back(order[k]);
+      }
+   }
+
+   // Soft-NMS per class the textbook way: keep the best remaining box, decay every other one.
+   void softReference(Candidates& c, float sigma)
+   {
+      for (int k = 0; k < kClasses; ++k)
+      {
+         std::vector<int> remaining;
+         for (size_t i = 0; i < c.dets.size(); ++i)
+            if (c.dets[i].prob[k] > kScoreThreshold)
+               remaining.push_back(i);
+         while (!remaining.empty())
+         {
+            std::vector<int>::iterator top = std::max_element(remaining.begin(), remaining.end(),
+               [&](int a, int b) { return c.dets[a].prob[k] < c.dets[b].prob[k]; });
+            box kept = c.dets[*top].bbox;
+            remaining.erase(top);
+            std::vector<int> next;
+            for (size_t j = 0; j < remaining.size(); ++j)
+            {
+               detection& det = c.dets[remaining[j]];
+               float iou = box_iou(kept, det.bbox);
+               det.prob[k] *= std::exp(-iou * iou / sigma);
+               if (det.prob[k] <= kScoreThreshold)
+                  det.prob[k] = 0;
+               else
+                  next.push_back(remaining[j]);
+            }
+            remaining.swap(next);
+         }
+      }
+   }
+
+   template <typename F>
+   double milliseconds(const Candidates& input, int repeats, F run)
+   {
+      double total = 0;
+      for (int r = 0; r < repeats; ++r)
+      {
+         Candidates c(input);
+         std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+         run(c);
+         total += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      }
+      return total / repeats;
+   }
+}
+
+TEST(Nms, ClassModeMatchesDoNmsSort)
+{
+   // Up to 10k candidates, so the grid takes over once 32 boxes of a class are kept.
+   for (int n : {100, 1000, 10000})
+   {
+      Candidates input = generate(n, n);
+      Candidates engine(input), darknet(input);
+      NmsEngine nms;
+      nms.configure(NMS_CLASS, kIou, false, .5f);
+      nms.apply(&engine.dets[0], n, kClasses, kScoreThreshold);
+      do_nms_sort(&darknet.dets[0], n, kClasses, kIou);
+      EXPECT_EQ(0, differences(engine.probs, darknet.probs, 0.f)) << n << " candidates";
+      EXPECT_LT(survivors(engine.probs), survivors(input.probs)) << n << " candidates";
+   }
+}
+
+TEST(Nms, DarknetModeIsDoNmsObj)
+{
+   Candidates input = generate(1000, 7);
+   Candidates engine(input), darknet(input);
+   NmsEngine nms;
+   nms.configure(NMS_DARKNET, kIou, true, .5f);
+   nms.apply(&engine.dets[0], 1000, kClasses, kScoreThreshold);
+   do_nms_obj(&darknet.dets[0], 1000, kClasses, kIou);
+   EXPECT_EQ(0, differences(engine.probs, darknet.probs, 0.f));
+}
+
+TEST(Nms, AgnosticModeMatchesGreedyReference)
+{
+   for (int n : {100, 1000, 10000})
+   {
+      Candidates input = generate(n, n + 1);
+      Candidates engine(input), reference(input);
+      NmsEngine nms;
+      nms.configure(NMS_AGNOSTIC, kIou, false, .5f);
+      nms.apply(&engine.dets[0], n, kClasses, kScoreThreshold);
+      agnosticReference(reference);
+      EXPECT_EQ(0, differences(engine.probs, reference.probs, 0.f)) << n << " candidates";
+   }
+}
+
+TEST(Nms, SoftNmsMatchesTextbookSoftNms)
+{
+   const float kSigma = .5f;
+   for (int n : {100, 1000})
+   {
+      Candidates input = generate(n, n + 2);
+      Candidates engine(input), reference(input);
+      NmsEngine nms;
+      nms.configure(NMS_CLASS, kIou, true, kSigma);
+      nms.apply(&engine.dets[0], n, kClasses, kScoreThreshold);
+      softReference(reference, kSigma);
+      // The engine sums the squared IoUs into one exponential, the reference multiplies one per kept box.
+      EXPECT_EQ(0, differences(engine.probs, reference.probs, 1e-4f)) << n << " candidates";
+   }
+}
+
+TEST(Nms, Timing)
+{
+   NmsEngine classNms, agnosticNms, softNms;
+   classNms.configure(NMS_CLASS, kIou, false, .5f);
+   agnosticNms.configure(NMS_AGNOSTIC, kIou, false, .5f);
+   softNms.configure(NMS_CLASS, kIou, true, .5f);
+   for (int n : {100, 1000, 10000})
+   {
+      Candidates input = generate(n, n);
+      const int repeats = n < 10000 ? 20 : 2;
+      double obj = milliseconds(input, repeats, [&](Candidates& c) { do_nms_obj(&c.dets[0], n, kClasses, kIou); });
+      double perClass = milliseconds(input, repeats, [&](Candidates& c) { classNms.apply(&c.dets[0], n, kClasses, kScoreThreshold); });
+      double agnostic = milliseconds(input, repeats, [&](Candidates& c) { agnosticNms.apply(&c.dets[0], n, kClasses, kScoreThreshold); });
+      double soft = milliseconds(input, repeats, [&](Candidates& c) { softNms.apply(&c.dets[0], n, kClasses, kScoreThreshold); });
+      printf("%5d candidates: do_nms_obj %.3f ms, class %.3f ms, agnostic %.3f ms, soft %.3f ms\n", n, obj, perClass, agnostic, soft);
+   }
+}
+
+int main(int argc, char **argv)
+{
+   testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
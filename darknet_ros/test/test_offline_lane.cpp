@@ -0,0 +1,168 @@
+/*
+ * test_offline_lane.cpp
+ *
+ *  Stress test of the offline lane queue: hundreds of goals arrive while a
+ *  camera stream keeps its own stage busy, a share of them is canceled
+ *  while queued, and every goal is either answered once, with its own id,
+ *  within the batching bound, or canceled.
+ */
+
+   // c++
+   #include <algorithm>
+   #include <atomic>
+   #include <chrono>
+   #include <cstdio>
+   #include <thread>
+   #include <vector>
+
+   // gtest
+   #include <gtest/gtest.h>
+
+#include "darknet_ros/DynamicBatcher.hpp"
+#include "darknet_ros/StageQueue.hpp"
+
+using namespace darknet_ros;
+
+namespace
+{
+   typedef std::chrono::steady_clock Clock;
+
+   struct Goal
+   {
+      int id;
+      Clock::time_point queued;
+   };
+}
+
+TEST(OfflineLane, GoalsDuringStreamingAreAnsweredOrCanceledOnce)
+{
+   const int kGoals = 600;
+   const size_t kBatch = 4;
+   const std::chrono::milliseconds kBatchTimeout(10);
+   const std::chrono::milliseconds kInference(1);
+   // Wait bound: the batch timeout plus one batch in service, with headroom for a loaded test machine.
+   const std::chrono::milliseconds kMaxWait(60);
+
+   DynamicBatcher<Goal> queue(kGoals);
+   std::vector<int> answered(kGoals, 0);
+   std::vector<int> canceled(kGoals, 0);
+   std::vector<int> order;
+   std::atomic<long> maxWaitUs(0);
+   std::atomic<bool> producing(true);
+
+   // The camera pipeline keeps streaming on its own queue while goals come in.
+   std::atomic<unsigned long> frames(0);
+   StageQueue<int> stream(2);
+   std::thread camera([&]
+   {
+      int frame = 0;
+      while (producing)
+      {
+         if (stream.tryPush(frame))
+            ++frame;
+         std::this_thread::sleep_for(std::chrono::microseconds(500));
+      }
+      stream.close();
+   });
+   std::thread detect([&]
+   {
+      int frame;
+      while (stream.pop(frame))
+         ++frames;
+   });
+
+   std::thread lane([&]
+   {
+      std::vector<Goal> batch;
+      while (queue.popBatch(batch, kBatch, kBatchTimeout))
+      {
+         EXPECT_LE(batch.size(), kBatch);
+         Clock::time_point start = Clock::now();
+         for (size_t b = 0; b < batch.size(); ++b)
+         {
+            long us = std::chrono::duration_cast<std::chrono::microseconds>(start - batch[b].queued).count();
+            long seen = maxWaitUs.load();
+            while (us > seen && !maxWaitUs.compare_exchange_weak(seen, us)) {}
+         }
+         std::this_thread::sleep_for(kInference);
+         for (size_t b = 0; b < batch.size(); ++b)
+         {
+            ++answered[batch[b].id];
+            order.push_back(batch[b].id);
+         }
+      }
+   });
+
+   // Every fifth goal is canceled right after it is queued, like an action client giving up.
+   for (int id = 0; id < kGoals; ++id)
+   {
+      Goal goal = {id, Clock::now()};
+      ASSERT_TRUE(queue.push(goal));
+      if (id % 5 == 0)
+      {
+         canceled[id] += queue.removeIf([id](const Goal& g) { return g.id == id; });
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(id % 3 == 0 ? 100 : 400));
+   }
+
+   // Let the lane drain, then shut it down the way the destructor does.
+   Clock::time_point deadline = Clock::now() + std::chrono::seconds(5);
+   while (queue.size() > 0 && Clock::now() < deadline)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+   std::this_thread::sleep_for(kBatchTimeout + 5 * kInference);
+   queue.close();
+   lane.join();
+   producing = false;
+   camera.join();
+   detect.join();
+
+   int served = 0;
+   for (int id = 0; id < kGoals; ++id)
+   {
+      EXPECT_EQ(1, answered[id] + canceled[id]) << "goal " << id;
+      served += answered[id];
+   }
+   EXPECT_GE(served, kGoals - (kGoals + 4) / 5);
+   EXPECT_TRUE(std::is_sorted(order.begin(), order.end()));
+   EXPECT_LE(maxWaitUs.load(), std::chrono::duration_cast<std::chrono::microseconds>(kMaxWait).count());
+   EXPECT_GT(frames.load(), 0u);
+   printf("goals %d, served %d, max wait %.2f ms, camera frames %lu\n", kGoals, served, maxWaitUs.load() / 1000., frames.load());
+}
+
+TEST(OfflineLane, LoneGoalWaitsOnlyTheBatchTimeout)
+{
+   DynamicBatcher<int> queue(8);
+   ASSERT_TRUE(queue.push(7));
+   std::vector<int> batch;
+   Clock::time_point start = Clock::now();
+   ASSERT_TRUE(queue.popBatch(batch, 4, std::chrono::milliseconds(20)));
+   double waited = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+   ASSERT_EQ(1u, batch.size());
+   EXPECT_EQ(7, batch[0]);
+   EXPECT_GE(waited, 15.);
+   EXPECT_LT(waited, 200.);
+}
+
+TEST(OfflineLane, FullQueueRejectsAndCloseWakesTheLane)
+{
+   DynamicBatcher<int> queue(2);
+   EXPECT_TRUE(queue.push(1));
+   EXPECT_TRUE(queue.push(2));
+   EXPECT_FALSE(queue.push(3));
+   EXPECT_EQ(2u, queue.removeIf([](int) { return true; }));
+   std::thread lane([&queue]
+   {
+      std::vector<int> batch;
+      EXPECT_FALSE(queue.popBatch(batch, 4, std::chrono::seconds(10)));
+   });
+   std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   queue.close();
+   lane.join();
+   EXPECT_FALSE(queue.push(4));
+}
+
+int main(int argc, char **argv)
+{
+   testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
@@ -0,0 +1,207 @@
+/*
+ * test_result_channel.cpp
+ *
+ *  Torn-read test of the shared-memory result channel: one writer publishes
+ *  frames as fast as it can while readers copy the latest frame and older
+ *  frames by index, and every copy they get must be a whole frame.
+ */
+
+   // c++
+   #include <algorithm>
+   #include <atomic>
+   #include <chrono>
+   #include <cstdio>
+   #include <string>
+   #include <thread>
+   #include <vector>
+
+   // POSIX
+   #include <sys/mman.h>
+   #include <unistd.h>
+
+   // gtest
+   #include <gtest/gtest.h>
+
+#include "darknet_ros/ResultChannel.hpp"
+
+using namespace darknet_ros;
+
+namespace
+{
+   // Every field is derived from the frame number, so a record mixing two frames is detected.
+   float fieldValue(uint64_t seq, uint32_t object, uint32_t field)
+   {
+      return (float) ((seq * 31 + object * 7 + field) % 65536);
+   }
+
+   void fillRecord(uint64_t seq, ResultFrameRecord& record)
+   {
+      std::memset(&record, 0, sizeof(record));
+      record.frameSeq = seq;
+      record.stampNs = seq * 1000003;
+      record.numObjects = seq % (kResultChannelMaxObjects + 1);
+      record.camera = seq % 4;
+      for (uint32_t i = 0; i < kResultChannelMaxObjects; ++i)
+      {
+         ObjectPoseRecord& object = record.objects[i];
+         object.classId = (int32_t) (seq + i);
+         object.flags = (seq + i) & kObjectPositionValid;
+         object.confidence = fieldValue(seq, i, 0);
+         for (int k = 0; k < 3; ++k)
+         {
+            object.position[k] = fieldValue(seq, i, 1 + k);
+            object.centre[k] = fieldValue(seq, i, 4 + k);
+         }
+         for (int k = 0; k < 4; ++k)
+         {
+            object.orientation[k] = fieldValue(seq, i, 7 + k);
+            object.plate[k] = fieldValue(seq, i, 11 + k);
+         }
+      }
+   }
+
+   bool isWhole(const ResultFrameRecord& record)
+   {
+      ResultFrameRecord expected;
+      fillRecord(record.frameSeq, expected);
+      return std::memcmp(&expected, &record, sizeof(record)) == 0;
+   }
+
+   std::string channelName()
+   {
+      return "/darknet_ros_test_" + std::to_string((long) getpid());
+   }
+}
+
+TEST(ResultChannel, ReaderSeesNothingBeforeTheFirstFrame)
+{
+   const std::string name = channelName();
+   ResultChannelReader missing;
+   shm_unlink(name.c_str());
+   EXPECT_FALSE(missing.open(name));
+
+   ResultChannelWriter writer;
+   ASSERT_TRUE(writer.open(name));
+   ResultChannelReader reader;
+   ASSERT_TRUE(reader.open(name));
+   ResultFrameRecord record;
+   EXPECT_EQ(0u, reader.frames());
+   EXPECT_FALSE(reader.readLatest(record));
+   EXPECT_FALSE(reader.read(0, record));
+   shm_unlink(name.c_str());
+}
+
+TEST(ResultChannel, OverwrittenFramesAreRejected)
+{
+   const std::string name = channelName();
+   ResultChannelWriter writer;
+   ASSERT_TRUE(writer.open(name));
+   ResultChannelReader reader;
+   ASSERT_TRUE(reader.open(name));
+
+   ResultFrameRecord record;
+   const uint64_t kFrames = 3 * kResultChannelSlots + 5;
+   for (uint64_t n = 0; n < kFrames; ++n)
+   {
+      fillRecord(n, record);
+      writer.publish(record);
+   }
+   EXPECT_EQ(kFrames, reader.frames());
+   ASSERT_TRUE(reader.readLatest(record));
+   EXPECT_EQ(kFrames - 1, record.frameSeq);
+   EXPECT_TRUE(isWhole(record));
+   ASSERT_TRUE(reader.read(kFrames - kResultChannelSlots, record));
+   EXPECT_EQ(kFrames - kResultChannelSlots, record.frameSeq);
+   EXPECT_FALSE(reader.read(kFrames - kResultChannelSlots - 1, record));
+   EXPECT_FALSE(reader.read(kFrames, record));
+   shm_unlink(name.c_str());
+}
+
+TEST(ResultChannel, ConcurrentReadersNeverSeeATornFrame)
+{
+   const std::string name = channelName();
+   const uint64_t kFrames = 200000;
+   const int kReaders = 3;
+   ResultChannelWriter writer;
+   ASSERT_TRUE(writer.open(name));
+
+   std::atomic<bool> writing(true);
+   std::atomic<int> torn(0);
+   std::atomic<int> wrongIndex(0);
+   std::atomic<int> backwards(0);
+   std::vector<unsigned long> reads(kReaders, 0);
+   std::vector<double> latencyUs(kReaders, 0);
+
+   std::vector<std::thread> readers;
+   for (int r = 0; r < kReaders; ++r)
+   {
+      readers.emplace_back([&, r]
+      {
+         // Each reader maps the channel on its own, like a separate process would.
+         ResultChannelReader reader;
+         if (!reader.open(name))
+         {
+            ++torn;
+            return;
+         }
+         ResultFrameRecord record;
+         uint64_t latest = 0;
+         std::chrono::steady_clock::duration spent(0);
+         while (writing)
+         {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            bool ok = reader.readLatest(record);
+            spent += std::chrono::steady_clock::now() - start;
+            if (!ok)
+               continue;
+            ++reads[r];
+            if (!isWhole(record))
+               ++torn;
+            if (record.frameSeq < latest)
+               ++backwards;
+            latest = record.frameSeq;
+
+            // Readers 1 and up also chase older frames, which the writer is about to overwrite.
+            if (r > 0 && latest >= kResultChannelSlots)
+            {
+               uint64_t index = latest - (reads[r] % kResultChannelSlots);
+               if (reader.read(index, record))
+               {
+                  if (!isWhole(record))
+                     ++torn;
+                  if (record.frameSeq != index)
+                     ++wrongIndex;
+               }
+            }
+         }
+         if (reads[r] > 0)
+            latencyUs[r] = std::chrono::duration<double, std::micro>(spent).count() / reads[r];
+      });
+   }
+
+   ResultFrameRecord record;
+   for (uint64_t n = 0; n < kFrames; ++n)
+   {
+      fillRecord(n, record);
+      writer.publish(record);
+   }
+   writing = false;
+   for (size_t r = 0; r < readers.size(); ++r)
+      readers[r].join();
+   shm_unlink(name.c_str());
+
+   EXPECT_EQ(0, torn.load());
+   EXPECT_EQ(0, wrongIndex.load());
+   EXPECT_EQ(0, backwards.load());
+   for (int r = 0; r < kReaders; ++r)
+   {
+      EXPECT_GT(reads[r], 0u);
+      printf("reader %d: %lu frames, %.2f us per readLatest\n", r, reads[r], latencyUs[r]);
+   }
+}
+
+int main(int argc, char **argv)
+{
+   testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
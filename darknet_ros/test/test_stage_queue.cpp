@@ -0,0 +1,115 @@
+/*
+ * test_stage_queue.cpp
+ *
+ *  Stress tests of the pipeline plumbing: StageQueue hands every item over
+ *  once and in order, and slots cycling through the fetch, detect, publish
+ *  and pose stages are always claimed from the stage that released them.
+ */
+
+   // c++
+   #include <atomic>
+   #include <memory>
+   #include <thread>
+   #include <vector>
+
+   // gtest
+   #include <gtest/gtest.h>
+
+#include "darknet_ros/StageQueue.hpp"
+
+using namespace darknet_ros;
+
+TEST(StageQueue, HandsOverEveryItemInOrder)
+{
+   const uint64_t kItems = 1000000;
+   StageQueue<uint64_t> queue(4);
+   std::thread producer([&queue, kItems]
+   {
+      for (uint64_t i = 0; i < kItems; ++i)
+         ASSERT_TRUE(queue.push(i));
+   });
+   uint64_t expected = 0;
+   uint64_t item;
+   while (expected < kItems && queue.pop(item))
+   {
+      ASSERT_EQ(expected, item);
+      ++expected;
+   }
+   producer.join();
+   EXPECT_EQ(kItems, expected);
+   EXPECT_EQ(0u, queue.size());
+}
+
+TEST(StageQueue, CloseWakesBlockedConsumer)
+{
+   StageQueue<int> queue(2);
+   std::atomic<bool> returned(false);
+   std::thread consumer([&queue, &returned]
+   {
+      int item;
+      EXPECT_FALSE(queue.pop(item));
+      returned = true;
+   });
+   std::this_thread::sleep_for(std::chrono::milliseconds(20));
+   EXPECT_FALSE(returned);
+   queue.close();
+   consumer.join();
+   EXPECT_TRUE(returned);
+   EXPECT_FALSE(queue.tryPush(1));
+}
+
+// The pipeline of YoloObjectDetector: four stages in a ring, the slots start out owned by the last one.
+TEST(SlotOwnership, RingOfStagesNeverMissesAClaim)
+{
+   const int kStages = 4;
+   const int kSlots = 3;
+   const int kHandoffs = 20000;   // Slots each stage takes.
+   SlotOwnership owners(kSlots, kStages - 1);
+   std::vector<std::unique_ptr<StageQueue<int> > > queues;
+   for (int s = 0; s < kStages; ++s)
+      queues.emplace_back(new StageQueue<int>(kSlots));
+   // Queue s feeds stage s, the free slots wait in front of stage 0.
+   for (int slot = 0; slot < kSlots; ++slot)
+      ASSERT_TRUE(queues[0]->tryPush(slot));
+
+   std::atomic<int> failures(0);
+   std::vector<std::thread> stages;
+   for (int s = 0; s < kStages; ++s)
+   {
+      stages.emplace_back([&, s]
+      {
+         const int previous = (s + kStages - 1) % kStages;
+         int slot;
+         for (int n = 0; n < kHandoffs; ++n)
+         {
+            if (!queues[s]->pop(slot))
+               return;
+            if (!owners.transfer(slot, previous, s))
+               ++failures;
+            // The last stage recycles the slot while stage 0 still has handoffs to take.
+            if (s != kStages - 1 || n + kSlots < kHandoffs)
+               queues[(s + 1) % kStages]->push(slot);
+         }
+      });
+   }
+   for (size_t s = 0; s < stages.size(); ++s)
+      stages[s].join();
+   EXPECT_EQ(0, failures.load());
+   for (int slot = 0; slot < kSlots; ++slot)
+      EXPECT_EQ(kStages - 1, owners.owner(slot));
+}
+
+TEST(SlotOwnership, ClaimFromWrongStageFails)
+{
+   SlotOwnership owners(1, 3);
+   EXPECT_FALSE(owners.transfer(0, 0, 1));
+   EXPECT_EQ(3, owners.owner(0));
+   EXPECT_TRUE(owners.transfer(0, 3, 0));
+   EXPECT_FALSE(owners.transfer(0, 3, 0));
+}
+
+int main(int argc, char **argv)
+{
+   testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
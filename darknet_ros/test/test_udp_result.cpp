@@ -0,0 +1,189 @@
+/*
+ * test_udp_result.cpp
+ *
+ *  Loopback tests of the UDP result transport: frames split into many
+ *  fragments arrive whole, and crafted datagrams that are duplicated,
+ *  missing, inconsistent or truncated never complete a frame.
+ */
+
+   // c++
+   #include <algorithm>
+   #include <cstdio>
+   #include <vector>
+
+   // POSIX
+   #include <arpa/inet.h>
+   #include <sys/socket.h>
+   #include <unistd.h>
+
+   // gtest
+   #include <gtest/gtest.h>
+
+#include "darknet_ros/UdpResultPublisher.hpp"
+
+using namespace darknet_ros;
+
+namespace
+{
+   // One port per test process, so parallel test runs do not receive each other's datagrams.
+   int testPort()
+   {
+      return 20000 + getpid() % 20000;
+   }
+
+   void fillRecord(uint64_t seq, uint32_t numObjects, ResultFrameRecord& record)
+   {
+      memset(&record, 0, sizeof(record));
+      record.frameSeq = seq;
+      record.stampNs = seq * 1000003;
+      record.numObjects = numObjects;
+      record.camera = seq % 2;
+      for (uint32_t i = 0; i < numObjects; ++i)
+      {
+         record.objects[i].classId = (int32_t) (seq * 100 + i);
+         record.objects[i].flags = kObjectPositionValid;
+         record.objects[i].confidence = 0.5f + i / 100.f;
+         record.objects[i].position[0] = (float) seq;
+         record.objects[i].position[1] = (float) i;
+         record.objects[i].orientation[3] = 1.f;
+      }
+   }
+
+   // Sends hand-made datagrams to the receiver, objects carry classId = firstObject + k + 1.
+   class RawSender
+   {
+      public:
+
+      RawSender()
+      {
+         socket_ = socket(AF_INET, SOCK_DGRAM, 0);
+         memset(&destination_, 0, sizeof(destination_));
+         destination_.sin_family = AF_INET;
+         destination_.sin_port = htons(testPort());
+         inet_pton(AF_INET, "127.0.0.1", &destination_.sin_addr);
+      }
+
+      ~RawSender()
+      {
+         ::close(socket_);
+      }
+
+      void send(uint64_t seq, int fragment, int fragments, int firstObject, int numObjects, int headerSize = sizeof(UdpResultHeader))
+      {
+         UdpResultHeader header;
+         memset(&header, 0, sizeof(header));
+         header.magic = kUdpResultMagic;
+         header.version = kUdpResultVersion;
+         header.headerSize = headerSize;
+         header.frameSeq = seq;
+         header.fragment = fragment;
+         header.fragments = fragments;
+         header.numObjects = numObjects;
+         header.totalObjects = 4;
+         header.firstObject = firstObject;
+         std::vector<unsigned char> buffer(std::max<int>(headerSize, sizeof(header)) + numObjects * sizeof(ObjectPoseRecord));
+         memcpy(&buffer[0], &header, sizeof(header));
+         for (int k = 0; k < numObjects; ++k)
+         {
+            ObjectPoseRecord object;
+            memset(&object, 0, sizeof(object));
+            object.classId = firstObject + k + 1;
+            memcpy(&buffer[headerSize + k * sizeof(object)], &object, sizeof(object));
+         }
+         buffer.resize(headerSize + numObjects * sizeof(ObjectPoseRecord));
+         sendto(socket_, &buffer[0], buffer.size(), 0, (const struct sockaddr*) &destination_, sizeof(destination_));
+      }
+
+      private:
+
+      int socket_;
+      struct sockaddr_in destination_;
+   };
+}
+
+TEST(UdpResult, PublisherRejectsDatagramLimitsOutOfRange)
+{
+   UdpResultPublisher tooSmall;
+   EXPECT_FALSE(tooSmall.open("127.0.0.1", testPort(), 1, kUdpMinDatagram - 1));
+   UdpResultPublisher tooLarge;
+   EXPECT_FALSE(tooLarge.open("127.0.0.1", testPort(), 1, kUdpMaxDatagram + 1));
+   UdpResultPublisher badAddress;
+   EXPECT_FALSE(badAddress.open("not an address", testPort(), 1, 1400));
+}
+
+TEST(UdpResult, FragmentedFramesArriveWhole)
+{
+   UdpResultReceiver receiver;
+   ASSERT_TRUE(receiver.open(testPort()));
+   UdpResultPublisher publisher;
+   // Five objects per datagram: a full frame of 32 objects takes 7 fragments.
+   ASSERT_TRUE(publisher.open("127.0.0.1", testPort(), 1, sizeof(UdpResultHeader) + 5 * sizeof(ObjectPoseRecord)));
+
+   const int kFrames = 500;
+   std::vector<double> latencyUs;
+   ResultFrameRecord sent, received;
+   for (int n = 0; n < kFrames; ++n)
+   {
+      // Full frames, an empty one and sizes on and off the fragment boundary.
+      uint32_t objects = n % 4 == 0 ? kResultChannelMaxObjects : (n * 7) % (kResultChannelMaxObjects + 1);
+      fillRecord(n, objects, sent);
+      uint64_t receiveNs = udpResultClockNs();
+      ASSERT_TRUE(publisher.send(sent, receiveNs));
+      uint64_t gotReceiveNs = 0;
+      ASSERT_TRUE(receiver.receive(received, gotReceiveNs, 1000)) << "frame " << n;
+      latencyUs.push_back((udpResultClockNs() - receiveNs) / 1000.);
+      EXPECT_EQ(receiveNs, gotReceiveNs);
+      EXPECT_EQ(0, memcmp(&sent, &received, sizeof(sent))) << "frame " << n << " with " << objects << " objects";
+   }
+   std::sort(latencyUs.begin(), latencyUs.end());
+   printf("%d frames, send to reassembled latency median %.1f us, max %.1f us\n", kFrames, latencyUs[latencyUs.size() / 2], latencyUs.back());
+}
+
+TEST(UdpResult, BrokenFragmentsNeverCompleteAFrame)
+{
+   UdpResultReceiver receiver;
+   ASSERT_TRUE(receiver.open(testPort()));
+   RawSender sender;
+   ResultFrameRecord record;
+   uint64_t receiveNs;
+
+   // Fragment 0 twice, fragment 1 missing.
+   sender.send(1, 0, 2, 0, 2);
+   sender.send(1, 0, 2, 0, 2);
+   EXPECT_FALSE(receiver.receive(record, receiveNs, 50));
+
+   // A count disagreeing with the frame, an index out of range, a header shorter than UdpResultHeader.
+   sender.send(1, 1, 3, 2, 2);
+   sender.send(1, 2, 2, 2, 2);
+   sender.send(1, 1, 2, 2, 2, 8);
+   EXPECT_FALSE(receiver.receive(record, receiveNs, 50));
+
+   // The missing fragment completes the frame, the duplicate did not overwrite anything.
+   sender.send(1, 1, 2, 2, 2);
+   ASSERT_TRUE(receiver.receive(record, receiveNs, 50));
+   EXPECT_EQ(1u, record.frameSeq);
+   ASSERT_EQ(4u, record.numObjects);
+   for (int k = 0; k < 4; ++k)
+      EXPECT_EQ(k + 1, record.objects[k].classId);
+
+   // Objects past the end of the record, more fragments than the receiver tracks.
+   sender.send(2, 0, 1, kResultChannelMaxObjects - 1, 2);
+   sender.send(2, 0, kUdpMaxFragments + 1, 0, 1);
+   EXPECT_FALSE(receiver.receive(record, receiveNs, 50));
+
+   // A fragment of a newer frame abandons the incomplete one.
+   sender.send(3, 0, 2, 0, 2);
+   sender.send(4, 1, 2, 2, 2);
+   sender.send(3, 1, 2, 2, 2);
+   EXPECT_FALSE(receiver.receive(record, receiveNs, 50));
+   sender.send(5, 0, 2, 0, 2);
+   sender.send(5, 1, 2, 2, 2);
+   ASSERT_TRUE(receiver.receive(record, receiveNs, 50));
+   EXPECT_EQ(5u, record.frameSeq);
+}
+
+int main(int argc, char **argv)
+{
+   testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}